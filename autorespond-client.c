@@ -0,0 +1,231 @@
+/*
+	autorespond-client for qmail
+
+	Hands a delivery to a running "autorespond --daemon socket", which
+	keeps its filters built between deliveries.
+
+	Usage:
+
+			autorespond-client time num message dir [ flag arsender ]
+
+		the arguments are those of autorespond. The socket is
+		$AUTORESPOND_SOCKET, or DAEMON_SOCKET below. If no daemon
+		answers, the delivery is run by AUTORESPOND_BIN itself.
+
+	Exit codes are those of autorespond:
+	0 - OK
+	99 - OK...stop processing lines in .qmail
+	100 - hard error
+	111 - soft error
+*/
+
+#ifndef DAEMON_SOCKET
+#define DAEMON_SOCKET "/var/run/autorespond/socket"
+#endif
+#ifndef AUTORESPOND_BIN
+#define AUTORESPOND_BIN "/usr/local/bin/autorespond"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define BUFFER_SIZE 65536
+
+/* environment a delivery gets from qmail-local */
+static char *forward_env[] = { "SENDER", "NEWSENDER", "RECIPIENT", "USER", "HOME", "HOST",
+	"LOCAL", "EXT", "DTLINE", "RPLINE", (char *)NULL };
+
+extern char **environ;
+
+static char *req;
+static size_t req_len = 0, req_size = 0;
+
+/****************************************************************/
+void add_field(const char * s, size_t len)
+{
+	if(req_len + len + 1 > req_size) {
+		req_size = (req_len + len + 1) * 2;
+		req = realloc(req, req_size);
+		if(req == NULL) {
+			/*exit...no memory*/
+			_exit(111);
+		}
+	}
+	memcpy(req + req_len, s, len);
+	req[req_len + len] = '\0';
+	req_len += len + 1;
+}
+
+void add_string(const char * s)
+{
+	add_field(s, strlen(s));
+}
+
+void add_number(unsigned int n)
+{
+char num[16];
+
+	snprintf(num, sizeof(num), "%u", n);
+	add_string(num);
+}
+
+/****************************************************************
+** the qmail environment and our own settings go to the daemon */
+
+int forwarded(const char * e)
+{
+int i;
+size_t len;
+
+	for(i = 0; forward_env[i] != NULL; i++) {
+		len = strlen(forward_env[i]);
+		if(strncmp(e, forward_env[i], len) == 0 && e[len] == '=')
+			return 1;
+	}
+	return strncmp(e, "AUTORESPOND_", 12) == 0 &&
+		strncmp(e, "AUTORESPOND_SOCKET=", 19) != 0 && strncmp(e, "AUTORESPOND_BIN=", 16) != 0;
+}
+
+/****************************************************************/
+int write_all(int fd, const char * buf, size_t len)
+{
+ssize_t w;
+
+	while(len > 0) {
+		w = write(fd, buf, len);
+		if(w == -1 && errno == EINTR)
+			continue;
+		if(w <= 0)
+			return -1;
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/****************************************************************
+** run the delivery in this process instead */
+
+void fallback(char ** argv)
+{
+char * bin;
+
+	bin = getenv("AUTORESPOND_BIN");
+	if(bin == NULL || *bin == '\0')
+		bin = AUTORESPOND_BIN;
+	argv[0] = bin;
+	execv(bin, argv);
+	fprintf(stderr, "AUTORESPOND: Unable to run %s: %s.\n", bin, strerror(errno));
+	_exit(111);
+}
+
+/****************************************************************/
+int main(int argc, char ** argv)
+{
+struct sockaddr_un addr;
+struct pollfd pfd;
+char * path;
+char cwd[PATH_MAX];
+char head[32];
+char buffer[BUFFER_SIZE];
+char * nul;
+ssize_t r;
+int sock;
+int sending = 1;
+int got_nul = 0;
+unsigned int i, n;
+
+	path = getenv("AUTORESPOND_SOCKET");
+	if(path == NULL || *path == '\0')
+		path = DAEMON_SOCKET;
+	if(strlen(path) >= sizeof(addr.sun_path) || getcwd(cwd, sizeof(cwd)) == NULL)
+		fallback(argv);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		/*no daemon, nothing was read from stdin yet*/
+		if(sock != -1)
+			close(sock);
+		fallback(argv);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/*the request: arguments, environment, working directory*/
+	add_number(argc - 1);
+	for(i = 1; i < (unsigned int)argc; i++)
+		add_string(argv[i]);
+	for(n = 0, i = 0; environ[i] != NULL; i++)
+		if(forwarded(environ[i]))
+			n++;
+	add_number(n);
+	for(i = 0; environ[i] != NULL; i++)
+		if(forwarded(environ[i]))
+			add_string(environ[i]);
+	add_string(cwd);
+
+	snprintf(head, sizeof(head), "%lu\n", (unsigned long)req_len);
+	if(write_all(sock, head, strlen(head)) == -1 || write_all(sock, req, req_len) == -1) {
+		fprintf(stderr, "AUTORESPOND: Lost connection to the daemon.\n");
+		_exit(111);
+	}
+
+	/*stream the message while copying back what the delivery says;
+	  a delivery may finish without reading all of it*/
+	for(;;) {
+		pfd.fd = sock;
+		pfd.events = POLLIN | (sending ? POLLOUT : 0);
+		if(poll(&pfd, 1, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			_exit(111);
+		}
+		if(pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			r = read(sock, buffer, sizeof(buffer));
+			if(r == -1 && errno == EINTR)
+				continue;
+			if(r <= 0)
+				break;
+			if(got_nul) {
+				/*the exit code follows the NUL*/
+				_exit((unsigned char)buffer[0]);
+			}
+			nul = memchr(buffer, '\0', r);
+			write_all(2, buffer, nul ? (size_t)(nul - buffer) : (size_t)r);
+			if(nul != NULL) {
+				if(nul + 1 < buffer + r)
+					_exit((unsigned char)nul[1]);
+				got_nul = 1;
+			}
+			continue;
+		}
+		if(sending && (pfd.revents & POLLOUT)) {
+			r = read(0, buffer, sizeof(buffer));
+			if(r == -1 && errno == EINTR)
+				continue;
+			if(r <= 0 || write_all(sock, buffer, r) == -1) {
+				shutdown(sock, SHUT_WR);
+				sending = 0;
+			}
+		}
+	}
+
+	/*the daemon went away before the delivery finished*/
+	fprintf(stderr, "AUTORESPOND: Lost connection to the daemon.\n");
+	_exit(111);
+	return 0;					/*compiler warning squelch*/
+}
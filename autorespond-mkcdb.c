@@ -0,0 +1,297 @@
+/*
+	autorespond-mkcdb for qmail
+
+	Builds the cdb that "autorespond --cdb file" takes the arguments of
+	each address from, so one .qmail-default can answer for all of them.
+
+	Usage:
+
+			autorespond-mkcdb file.cdb [ input ]
+			autorespond-mkcdb -s senders.cdb [ input ]
+
+		input (standard input if not given) has a line per address:
+
+			address time num message dir [ flag arsender ]
+
+		the arguments are those of autorespond. address is what
+		EXT@HOST or RECIPIENT of the delivery will be, or @host for
+		every address of a domain that isn't listed. A line
+
+			:name file
+
+		stores the contents of file in the cdb, for the addresses
+		whose message is :name. Empty lines and lines starting with #
+		are skipped. file.cdb is replaced atomically.
+
+		with -s, the sender lists of CONFIG_DIR/senders.cdb are built
+		instead, from lines
+
+			allow|deny address|domain [ recipient ]
+
+		an address or domain that is allowed always gets a reply (but
+		for loops and the limit), one that is denied never does. a
+		domain covers its subdomains. with a recipient (EXT@HOST) the
+		line is only for that address, and comes before the others.
+
+	Exit codes:
+	0 - OK
+	111 - error, file.cdb is left as it was
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <limits.h>
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define MAX_FIELDS 7
+
+typedef struct _entry {
+	unsigned int hash;
+	unsigned int pos;
+} entry;
+
+static FILE * out;
+static char tmp[PATH_MAX];
+static unsigned long long pos = 2048;
+static entry * entries;
+static size_t count = 0, size = 0;
+
+/****************************************************************/
+void fail(const char * why, const char * what)
+{
+	fprintf(stderr, "autorespond-mkcdb: %s%s%s.\n", why, what ? ": " : "", what ? what : "");
+	if(out != NULL)
+		unlink(tmp);
+	_exit(111);
+}
+
+void * safe_realloc(void * p, size_t n)
+{
+	if((p = realloc(p, n)) == NULL)
+		fail("out of memory", NULL);
+	return p;
+}
+
+unsigned int cdb_hash(const char * key, size_t len)
+{
+unsigned int h = 5381;
+
+	while(len-- > 0)
+		h = ((h << 5) + h) ^ (unsigned char)*key++;
+	return h;
+}
+
+void put_uint(char * p, unsigned int u)
+{
+	p[0] = u & 255;
+	p[1] = (u >> 8) & 255;
+	p[2] = (u >> 16) & 255;
+	p[3] = (u >> 24) & 255;
+}
+
+void put(const char * p, size_t n)
+{
+	if(fwrite(p, 1, n, out) != n)
+		fail("unable to write", tmp);
+	pos += n;
+	if(pos > 0xffffffffULL)
+		fail("the cdb would be over 4 GB", NULL);
+}
+
+/****************************************************************
+** a record: key and data lengths, key, data */
+
+void add(const char * key, size_t klen, const char * data, size_t dlen)
+{
+char head[8];
+
+	if(count == size) {
+		size = size ? size * 2 : 1024;
+		entries = safe_realloc(entries, size * sizeof(entry));
+	}
+	entries[count].hash = cdb_hash(key, klen);
+	entries[count].pos = pos;
+	count++;
+	put_uint(head, klen);
+	put_uint(head + 4, dlen);
+	put(head, 8);
+	put(key, klen);
+	put(data, dlen);
+}
+
+/****************************************************************
+** the 256 hash tables, twice as many slots as entries, and the
+** table of them at the start */
+
+void finish(void)
+{
+char header[2048];
+char slot[8];
+entry * table;
+size_t i, n, t, s, slots;
+
+	table = safe_realloc(NULL, (count * 2 + 1) * sizeof(entry));
+	for(t = 0; t < 256; t++) {
+		for(n = 0, i = 0; i < count; i++)
+			if((entries[i].hash & 255) == t)
+				n++;
+		slots = n * 2;
+		put_uint(header + t * 8, pos);
+		put_uint(header + t * 8 + 4, slots);
+		memset(table, 0, slots * sizeof(entry));
+		for(i = 0; i < count; i++) {
+			if((entries[i].hash & 255) != t)
+				continue;
+			for(s = (entries[i].hash >> 8) % slots; table[s].pos != 0; s = (s + 1) % slots)
+				;
+			table[s] = entries[i];
+		}
+		for(s = 0; s < slots; s++) {
+			put_uint(slot, table[s].hash);
+			put_uint(slot + 4, table[s].pos);
+			put(slot, 8);
+		}
+	}
+	free(table);
+	if(fseek(out, 0, SEEK_SET) == -1 || fwrite(header, 1, sizeof(header), out) != sizeof(header))
+		fail("unable to write", tmp);
+}
+
+/****************************************************************
+** a template line: ":name file" */
+
+void add_template(char * name, char * file, unsigned int lineno)
+{
+FILE * f;
+char * data = NULL;
+size_t len = 0, n;
+char buf[8192];
+
+	if(file == NULL) {
+		fprintf(stderr, "autorespond-mkcdb: line %u: no file for template %s.\n", lineno, name);
+		fail("nothing was written", NULL);
+	}
+	if((f = fopen(file, "r")) == NULL)
+		fail("unable to read", file);
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		data = safe_realloc(data, len + n);
+		memcpy(data + len, buf, n);
+		len += n;
+	}
+	if(ferror(f))
+		fail("unable to read", file);
+	fclose(f);
+	add(name, strlen(name), data, len);
+	free(data);
+}
+
+/****************************************************************
+** a sender list line: "allow|deny address|domain [ recipient ]" */
+
+void add_sender(char ** field, int n, unsigned int lineno)
+{
+char key[1024];
+char * p;
+size_t len;
+
+	if(n < 2 || n > 3 || (strcmp(field[0], "allow") != 0 && strcmp(field[0], "deny") != 0)) {
+		fprintf(stderr, "autorespond-mkcdb: line %u: want allow|deny address|domain [ recipient ].\n", lineno);
+		fail("nothing was written", NULL);
+	}
+	if(*field[1] == '@')
+		field[1]++;
+	if(n == 3)
+		len = snprintf(key, sizeof(key), "%s %s", field[2], field[1]);
+	else
+		len = snprintf(key, sizeof(key), "%s", field[1]);
+	if(len >= sizeof(key)) {
+		fprintf(stderr, "autorespond-mkcdb: line %u is too long.\n", lineno);
+		fail("nothing was written", NULL);
+	}
+	for(p = key; *p != '\0'; p++)
+		*p = tolower((unsigned char)*p);
+	add(key, len, *field[0] == 'a' ? "+" : "-", 1);
+}
+
+/****************************************************************/
+int main(int argc, char ** argv)
+{
+FILE * in = stdin;
+char line[4096];
+char value[4096];
+char * field[MAX_FIELDS + 1];
+char * p;
+size_t vlen;
+unsigned int lineno = 0;
+int n, i;
+int senders = 0;
+
+	if(argc > 1 && strcmp(argv[1], "-s") == 0) {
+		senders = 1;
+		argv++;
+		argc--;
+	}
+	if(argc < 2 || argc > 3) {
+		fprintf(stderr, "autorespond-mkcdb: usage: autorespond-mkcdb [ -s ] file.cdb [ input ]\n");
+		_exit(111);
+	}
+	if(argc == 3 && (in = fopen(argv[2], "r")) == NULL)
+		fail("unable to read", argv[2]);
+	if((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", argv[1]) >= sizeof(tmp))
+		fail("name too long", argv[1]);
+	if((out = fopen(tmp, "w")) == NULL)
+		fail("unable to create", tmp);
+	memset(line, 0, 2048);
+	if(fwrite(line, 1, 2048, out) != 2048)
+		fail("unable to write", tmp);
+
+	while(fgets(line, sizeof(line), in) != NULL) {
+		lineno++;
+		if(strchr(line, '\n') == NULL && !feof(in)) {
+			fprintf(stderr, "autorespond-mkcdb: line %u is too long.\n", lineno);
+			fail("nothing was written", NULL);
+		}
+		for(n = 0, p = strtok(line, " \t\r\n"); p != NULL && n <= MAX_FIELDS; p = strtok(NULL, " \t\r\n"))
+			field[n++] = p;
+		if(n == 0 || *field[0] == '#')
+			continue;
+		if(senders) {
+			add_sender(field, n, lineno);
+			continue;
+		}
+		if(*field[0] == ':') {
+			add_template(field[0], n > 1 ? field[1] : NULL, lineno);
+			continue;
+		}
+		if(n < 5 || n > MAX_FIELDS) {
+			fprintf(stderr, "autorespond-mkcdb: line %u: want address time num message dir [ flag arsender ].\n", lineno);
+			fail("nothing was written", NULL);
+		}
+		/*the address in lower case, the arguments each ended by a NUL*/
+		for(p = field[0]; *p != '\0'; p++)
+			*p = tolower((unsigned char)*p);
+		for(vlen = 0, i = 1; i < n; i++) {
+			memcpy(value + vlen, field[i], strlen(field[i]) + 1);
+			vlen += strlen(field[i]) + 1;
+		}
+		add(field[0], strlen(field[0]), value, vlen);
+	}
+	if(ferror(in))
+		fail("unable to read input", NULL);
+
+	finish();
+	if(fflush(out) == EOF || fsync(fileno(out)) == -1 || fclose(out) == EOF)
+		fail("unable to write", tmp);
+	out = NULL;
+	if(rename(tmp, argv[1]) == -1) {
+		unlink(tmp);
+		fail("unable to replace", argv[1]);
+	}
+	return 0;
+}
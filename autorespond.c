@@ -70,7 +70,12 @@ RPLINE - Return-Path
 */
 
 /*Change this value here to the location of your qmail*/
+#ifndef QMAIL_LOCATION
 #define QMAIL_LOCATION "/var/qmail"
+#endif
+
+/*Location of the optional data files, can be overridden with $AUTORESPOND_CONFIG*/
+#define CONFIG_DIR "/etc/autorespond"
 
 #include <time.h>
 #include <dirent.h>
@@ -83,29 +88,139 @@ RPLINE - Return-Path
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdint.h>
 #include <ctype.h>
-#include <regex.h>
 #include <limits.h>
+#include <regex.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CASESEARCH_SIMD
+#endif
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 #define DEFAULT_MH	1	/* default value for message_handling flag */
 #define DEFAULT_FROM	"$"	/* default "from" for the autorespond */
 
 #define WITH_OMESSAGE	1
 
-#define SENDER_FILTER_LIST "(abuse|account|activation|admin|alert|announce|assistance|auto.?reply|automate|billing|bounce|careers|complaints|compliance|confirm|contact|customer|daemon|deals|delivery|do.?not.?reply|enquir(y|ies)|feedback|finance|fraud|help|info|inquir(y|ies)|invoic(e|ing)|jobs|legal|mailer|maintenance|marketing|news|no.?reply|notification|offers|onboard|opt.?out|order|payment|postmaster|privacy|project|promo|recovery|recruit|registration|reset|sales|security|service|shipping|subscribe|support|system|undeliver|update|urgent|verif(y|ication)|webmaster|welcome).*@|[@.](abcnews\\.go\\.com|activecampaign\\.com|acxiom\\.com|airbnb\\.com|aliexpress\\.com|amazon\\.com|amazonses\\.com|americanexpress\\.com|apnews\\.com|atlassian\\.com|audible\\.com|aweber\\.com|bankofamerica\\.com|bbc\\.com|beehiiv\\.com|benchmark\\.email|bestbuy\\.com|bitbucket\\.org|bluesky\\.app|booking\\.com|bostonglobe\\.com|bronto\\.com|bsky\\.app|buttondown\\.email|campaignmonitor\\.com|cashapp\\.com|cbsnews\\.com|chase\\.com|cheetahmail\\.com|chicagotribune\\.com|circleci\\.com|clubhouse\\.com|cnn\\.com|codecov\\.io|constantcontact\\.com|convertkit\\.com|crisp\\.chat|deezer\\.com|desk\\.com|discord\\.com|discoursemail\\.com|discoveryplus\\.com|disneyplus\\.com|docker\\.com|drift\\.com|drip\\.com|ebay\\.com|edx\\.org|elasticemail\\.com|eloqua\\.com|emailoctopus\\.com|emarsys\\.com|epsilon\\.com|etsy\\.com|exacttarget\\.com|expedia\\.com|experian\\.com|facebook\\.com|facebookmail\\.com|flickr\\.com|foxnews\\.com|freshdesk\\.com|freshworks\\.com|getresponse\\.com|ghost\\.org|github\\.com|gitlab\\.com|google\\.com|groove\\.co|gumroad\\.com|hbomax\\.com|helpscout\\.com|helpshift\\.com|hilton\\.com|homedepot\\.com|hotels\\.com|hubspot\\.com|hulu\\.com|instagram\\.com|intercom\\.com|iterable\\.com|jenkins\\.io|kayak\\.com|kayako\\.com|kik\\.com|klaviyo\\.com|latimes\\.com|line\\.me|linkedin\\.com|listrak\\.com|livechat\\.com|lyft\\.com|mailchimpapp\\.com|mailerlite\\.com|mailersend\\.com|mailgun\\.net|mailjet\\.com|mandrill\\.com|marketo\\.com|marriott\\.com|mastercard\\.com|mastodon\\.social|mautic\\.org|medium\\.com|meetup\\.com|mlsend\\.com|moosend\\.com|nbcnews\\.com|netflix\\.com|newegg\\.com|nextdoor\\.com|npmjs\\.com|npr\\.org|nypost\\.com|nytimes\\.com|olark\\.com|omnisend\\.com|pandora\\.com|paramountplus\\.com|pardot\\.com|patreon\\.com|paypal\\.com|peacocktv\\.com|pepipost\\.com|phplist\\.com|pinterest\\.com|politico\\.com|postmark\\.com|postmarkapp\\.com|primevideo\\.com|quickbooks\\.intuit\\.com|reddit\\.com|responsys\\.com|reuters\\.com|revue\\.getrevue\\.co|sailthru\\.com|salesforce\\.com|sendfox\\.com|sendgrid\\.net|sendinblue\\.com|sendpulse\\.com|sendwithus\\.com|sendy\\.co|sfgate\\.com|shopify\\.com|signal\\.org|silverpop\\.com|skype\\.com|skyscanner\\.net|slack\\.com|smtp\\.com|snapchat\\.com|socketlabs\\.com|sparkpost\\.com|spotify\\.com|squareup\\.com|stackoverflow\\.com|stripe\\.com|substack\\.com|target\\.com|tawk\\.to|telegram\\.org|theguardian\\.com|threads\\.net|tiktok\\.com|tinyletter\\.com|tripadvisor\\.com|trivago\\.com|tumblr\\.com|turbosmtp\\.com|twitch\\.tv|twitter\\.com|uber\\.com|usatoday\\.com|uservoice\\.com|venmo\\.com|viber\\.com|vimeo\\.com|visa\\.com|walmart\\.com|washingtonpost\\.com|wayfair\\.com|wechat\\.com|wellsfargo\\.com|whatsapp\\.com|wsj\\.com|x\\.com|yesmail\\.com|youtube\\.com|zellepay\\.com|zendesk\\.com|zoom\\.us|zopim\\.com)(>|$)"
-
-#define HR_BUFFER_SIZE 1024
-
+/* role-account keywords, matched anywhere in the local part of a sender
+   address. ".?" stands for an optional separator character, as in
+   "no.?reply". More can be listed, one per line, in CONFIG_DIR/filter_keywords */
+static char *sender_filter_keywords[] = {
+	"abuse", "account", "activation", "admin", "alert", "announce", "assistance", "auto.?reply",
+	"automate", "billing", "bounce", "careers", "complaints", "compliance", "confirm", "contact",
+	"customer", "daemon", "deals", "delivery", "do.?not.?reply", "enquiry", "enquiries",
+	"feedback", "finance", "fraud", "help", "info", "inquiry", "inquiries", "invoice", "invoicing",
+	"jobs", "legal", "mailer", "maintenance", "marketing", "news", "no.?reply", "notification",
+	"offers", "onboard", "opt.?out", "order", "payment", "postmaster", "privacy", "project",
+	"promo", "recovery", "recruit", "registration", "reset", "sales", "security", "service",
+	"shipping", "subscribe", "support", "system", "undeliver", "update", "urgent", "verify",
+	"verification", "webmaster", "welcome", NULL
+};
+
+/* bulk-sender domains, matched against the domain of each sender address
+   together with all of their subdomains. More can be listed, one per line,
+   in CONFIG_DIR/filter_domains */
+static char *sender_filter_domains[] = {
+	"abcnews.go.com", "activecampaign.com", "acxiom.com", "airbnb.com", "aliexpress.com",
+	"amazon.com", "amazonses.com", "americanexpress.com", "apnews.com", "atlassian.com",
+	"audible.com", "aweber.com", "bankofamerica.com", "bbc.com", "beehiiv.com", "benchmark.email",
+	"bestbuy.com", "bitbucket.org", "bluesky.app", "booking.com", "bostonglobe.com", "bronto.com",
+	"bsky.app", "buttondown.email", "campaignmonitor.com", "cashapp.com", "cbsnews.com",
+	"chase.com", "cheetahmail.com", "chicagotribune.com", "circleci.com", "clubhouse.com",
+	"cnn.com", "codecov.io", "constantcontact.com", "convertkit.com", "crisp.chat", "deezer.com",
+	"desk.com", "discord.com", "discoursemail.com", "discoveryplus.com", "disneyplus.com",
+	"docker.com", "drift.com", "drip.com", "ebay.com", "edx.org", "elasticemail.com", "eloqua.com",
+	"emailoctopus.com", "emarsys.com", "epsilon.com", "etsy.com", "exacttarget.com", "expedia.com",
+	"experian.com", "facebook.com", "facebookmail.com", "flickr.com", "foxnews.com",
+	"freshdesk.com", "freshworks.com", "getresponse.com", "ghost.org", "github.com", "gitlab.com",
+	"google.com", "groove.co", "gumroad.com", "hbomax.com", "helpscout.com", "helpshift.com",
+	"hilton.com", "homedepot.com", "hotels.com", "hubspot.com", "hulu.com", "instagram.com",
+	"intercom.com", "iterable.com", "jenkins.io", "kayak.com", "kayako.com", "kik.com",
+	"klaviyo.com", "latimes.com", "line.me", "linkedin.com", "listrak.com", "livechat.com",
+	"lyft.com", "mailchimpapp.com", "mailerlite.com", "mailersend.com", "mailgun.net",
+	"mailjet.com", "mandrill.com", "marketo.com", "marriott.com", "mastercard.com",
+	"mastodon.social", "mautic.org", "medium.com", "meetup.com", "mlsend.com", "moosend.com",
+	"nbcnews.com", "netflix.com", "newegg.com", "nextdoor.com", "npmjs.com", "npr.org",
+	"nypost.com", "nytimes.com", "olark.com", "omnisend.com", "pandora.com", "paramountplus.com",
+	"pardot.com", "patreon.com", "paypal.com", "peacocktv.com", "pepipost.com", "phplist.com",
+	"pinterest.com", "politico.com", "postmark.com", "postmarkapp.com", "primevideo.com",
+	"quickbooks.intuit.com", "reddit.com", "responsys.com", "reuters.com", "revue.getrevue.co",
+	"sailthru.com", "salesforce.com", "sendfox.com", "sendgrid.net", "sendinblue.com",
+	"sendpulse.com", "sendwithus.com", "sendy.co", "sfgate.com", "shopify.com", "signal.org",
+	"silverpop.com", "skype.com", "skyscanner.net", "slack.com", "smtp.com", "snapchat.com",
+	"socketlabs.com", "sparkpost.com", "spotify.com", "squareup.com", "stackoverflow.com",
+	"stripe.com", "substack.com", "target.com", "tawk.to", "telegram.org", "theguardian.com",
+	"threads.net", "tiktok.com", "tinyletter.com", "tripadvisor.com", "trivago.com", "tumblr.com",
+	"turbosmtp.com", "twitch.tv", "twitter.com", "uber.com", "usatoday.com", "uservoice.com",
+	"venmo.com", "viber.com", "vimeo.com", "visa.com", "walmart.com", "washingtonpost.com",
+	"wayfair.com", "wechat.com", "wellsfargo.com", "whatsapp.com", "wsj.com", "x.com",
+	"yesmail.com", "youtube.com", "zellepay.com", "zendesk.com", "zoom.us", "zopim.com", NULL
+};
+
+/* our own Delivered-To header means a mail loop: a CONFIG_DIR/rules
+   file gets this rule before its own, so it can't be left out */
+#define LOOP_RULE	"contains	Delivered-To	Autoresponder	100	This message is looping...it has my Delivered-To header."
+
+/* the rules a message is checked against, used when there is no
+   CONFIG_DIR/rules. each line is "kind header[,header...] [pattern] exit
+   message", the first rule (in this order) that matches decides */
+static char *default_rules[] = {
+	"present	Mailing-List		0	This looks like it's from a mailing list, I will ignore it.",
+	LOOP_RULE,
+	"contains	Precedence	junk	0	Junk mail received.",
+	"contains	Precedence	bulk	0	Junk mail received.",
+	"contains	Precedence	list	0	Junk mail received.",
+	"present	List-Id			0	Message has List-Id header, ignoring.",
+	"present	List-Unsubscribe	0	Message has List-Unsubscribe header, ignoring.",
+	/* most commonly on transactional messages, although a very small
+	   number of boutique hosting providers use it: false positives */
+	"present	X-Report-Abuse-To	0	Message has X-Report-Abuse-To header, ignoring.",
+	"present	X-Patreon-UUID		0	Message has X-Patreon-UUID header, ignoring.",
+	"present	X-Mailgun-Tag		0	Message has X-Mailgun-Tag header, ignoring.",
+	"contains	X-Spam-Level	*	0	X-Spam-Level header contains asterisk, ignoring: %s.",
+	"contains	User-Agent	mailx	0	User-Agent header contains CLI-based mail agent, ignoring: %s.",
+	"contains	User-Agent	s-nail	0	User-Agent header contains CLI-based mail agent, ignoring: %s.",
+	"addrlist	Sender,From,Reply-To,Return-Path	0	%h header matches filter list, ignoring: %s.",
+	NULL
+};
+
+/* the headers of the message, or of the MIME part being read.
+   each is a slice of one block: the mapped message itself, or a copy
+   of the header lines for other input. content is unfolded in place
+   the first time it is asked for, so a copy made later carries it */
 typedef struct _headers {
-	char *tag;
-	char *content;
-	struct _headers *next;
+	size_t tag;		/*offset of the name in header_base*/
+	size_t tag_len;
+	size_t raw;		/*offset of the content, folds and all*/
+	size_t raw_len;
+	int unfolded;		/*content is unfolded in place at raw*/
+	unsigned int hash;	/*of the case folded name*/
+	int next;		/*next header of that name, -1 for none*/
 } headers;
 
 headers *header = (headers *)NULL;
+int header_count = 0;
+static int header_size = 0;
+/* names to their first header, open addressing, -1 for empty */
+static int *header_table = (int *)NULL;
+static unsigned int header_table_size = 0;
+static char *header_base = (char *)NULL;
+static char *header_block = (char *)NULL;
+static size_t header_block_size = 0;
+
+#define HEADER_TAG(h)	(header_base + (h)->tag)
 
 
 
@@ -121,8 +236,15 @@ char * read_file(char * filename);
 int validate_directory_path(const char *path);
 int validate_email_address(const char *email);
 int create_secure_temp_file(char *filename_buf, size_t buf_size, const char *prefix);
-char* sanitize_header_content(const char* content);
-int validate_header_tag(const char* tag);
+size_t sanitize_header_content(char* content, size_t len);
+int validate_header_tag(const char* tag, size_t len);
+void index_headers(void);
+unsigned int header_hash( const char *tag, size_t len );
+int deliver(int argc, char ** argv);
+int cdb_main(int argc, char ** argv);
+int batch_main(int argc, char ** argv);
+int replay_main(int argc, char ** argv);
+void files_queue_expiry( const char *sdir, unsigned int timer );
 
 /****************************************************************/
 
@@ -195,27 +317,18 @@ int create_secure_temp_file(char *filename_buf, size_t buf_size, const char *pre
     return fd;
 }
 
-/* Sanitize header content to prevent injection attacks */
-char* sanitize_header_content(const char* content) {
-    size_t len;
-    char* sanitized;
+/* Sanitize header content to prevent injection attacks:
+   unfolds it in place and returns the new length */
+size_t sanitize_header_content(char* content, size_t len) {
     size_t j = 0;
     size_t i;
 
-    if (!content) return NULL;
-
-    len = strlen(content);
-    if (len > 8192) {  /* Limit header length */
-        return NULL;
-    }
-
-    sanitized = (char*)safe_malloc(len + 1);
-
     for (i = 0; i < len; i++) {
         unsigned char c = content[i];
 
-        /* Remove control characters except tab, CR, LF */
-        if (c < 32 && c != '\t' && c != '\r' && c != '\n') {
+        /* Remove control characters except tab; line breaks of
+           continued headers go too, the whitespace after them stays */
+        if (c < 32 && c != '\t') {
             continue;
         }
 
@@ -224,37 +337,28 @@ char* sanitize_header_content(const char* content) {
             continue;
         }
 
-        /* Prevent header injection */
-        if (c == '\n' || c == '\r') {
-            /* Only allow if followed by whitespace (header continuation) */
-            if (i + 1 < len && (content[i + 1] == ' ' || content[i + 1] == '\t')) {
-                sanitized[j++] = c;
-            }
-        } else {
-            sanitized[j++] = c;
-        }
+        content[j++] = c;
     }
 
-    sanitized[j] = '\0';
-    return sanitized;
+    return j;
 }
 
 /* Validate header tag format */
-int validate_header_tag(const char* tag) {
-    const char* p;
+int validate_header_tag(const char* tag, size_t len) {
+    size_t i;
 
-    if (!tag || strlen(tag) == 0) {
+    if (!tag || len == 0) {
         return 0;
     }
 
     /* Check length limit */
-    if (strlen(tag) > 256) {
+    if (len > 256) {
         return 0;
     }
 
     /* Header tags should only contain printable ASCII characters */
-    for (p = tag; *p; p++) {
-        if (*p < 33 || *p > 126 || *p == ':') {
+    for (i = 0; i < len; i++) {
+        if (tag[i] < 33 || tag[i] > 126 || tag[i] == ':') {
             return 0;
         }
     }
@@ -351,67 +455,390 @@ char * frb;
 }
 
 
+/****************************************************************
+** map_file - map a file read only, for writing it out without a copy.
+** returns NULL on failure; an empty file maps to "" */
+
+char * map_file(char * filename, size_t * len)
+{
+int fd;
+struct stat st;
+char * p;
+
+	if(!filename || (fd = open(filename, O_RDONLY)) == -1) {
+		/*failed*/
+		return NULL;
+	}
+	if(fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	*len = st.st_size;
+	if(*len == 0) {
+		close(fd);
+		return "";
+	}
+	p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) {
+		return NULL;
+	}
+	return p;
+}
+
+
+/****************************************************************
+** the delivered message on stdin
+** qmail-local hands it over as a regular file, which is mapped and
+** read in place. anything else (a pipe, the daemon's socket) is read
+** into a buffer: lines before pin stay put, lines the caller is done
+** with are dropped when the buffer fills, unless hold is set. the
+** buffer always has a byte to spare after the data */
+
+#define INPUT_BUFFER_SIZE 65536
+
+typedef struct _input {
+	int fd;
+	int mapped;				/*base is a mapping of fd*/
+	int eof;
+	int hold;				/*keep lines already returned*/
+	char *base;
+	size_t len;				/*bytes in base*/
+	size_t pos;				/*next byte to return*/
+	size_t pin;				/*bytes at the start that are never dropped*/
+	size_t size;				/*allocated, when reading into a buffer*/
+	size_t total;				/*bytes of the message taken in*/
+} input;
+
+input message_input;
+
+void input_open(input * in, int fd)
+{
+struct stat st;
+off_t off;
+void * p;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = fd;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+		&& (off = lseek(fd, 0, SEEK_CUR)) != (off_t)-1 && st.st_size > off) {
+		/*private and writable: headers are unfolded in place*/
+		p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		/*a last line without a newline leaves no room to terminate
+		  a header in place, read such a message instead*/
+		if(p != MAP_FAILED && ((char *)p)[st.st_size - 1] != '\n') {
+			munmap(p, st.st_size);
+			p = MAP_FAILED;
+		}
+		if(p != MAP_FAILED) {
+			/*read once from start to end*/
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			in->mapped = 1;
+			in->eof = 1;
+			in->base = p;
+			in->len = st.st_size;
+			in->pos = off;
+			in->pin = off;
+			in->total = st.st_size - off;
+			return;
+		}
+	}
+	in->size = INPUT_BUFFER_SIZE;
+	in->base = (char *)safe_malloc(in->size);
+}
+
+/* read more of the message, making room first; 0 at the end */
+ssize_t input_fill(input * in)
+{
+ssize_t r;
+
+	if(in->eof)
+		return 0;
+	if(in->len + 1 == in->size) {
+		if(!in->hold && in->pos > in->pin) {
+			memmove(in->base + in->pin, in->base + in->pos, in->len - in->pos);
+			in->len -= in->pos - in->pin;
+			in->pos = in->pin;
+		} else {
+			in->size *= 2;
+			in->base = (char *)safe_realloc(in->base, in->size);
+		}
+	}
+	do
+		r = read(in->fd, in->base + in->len, in->size - in->len - 1);
+	while(r == -1 && errno == EINTR);
+	if(r <= 0) {
+		in->eof = 1;
+		return 0;
+	}
+	in->len += r;
+	in->total += r;
+	return r;
+}
+
+/* the next line, with its newline if it has one; 0 at the end.
+   the line stays valid until the next call, or longer with hold */
+size_t input_line(input * in, char ** line)
+{
+char * nl;
+size_t scanned = 0;
+size_t n;
+
+	for(;;) {
+		nl = memchr(in->base + in->pos + scanned, '\n', in->len - in->pos - scanned);
+		if(nl != NULL) {
+			n = nl + 1 - (in->base + in->pos);
+			break;
+		}
+		scanned = in->len - in->pos;
+		if(input_fill(in) == 0) {
+			n = in->len - in->pos;
+			break;
+		}
+	}
+	*line = in->base + in->pos;
+	in->pos += n;
+	return n;
+}
+
+
+/****************************************************************
+** cdb - look up keys in a constant database (the format of D. J.
+** Bernstein's cdb): 256 hash tables named by the first 2048 bytes,
+** the records, then the tables. the file is mapped, a lookup reads
+** the slots of one table until the key or an empty one */
+
+typedef struct _cdb {
+	char * map;
+	size_t size;
+} cdb;
+
+static unsigned int cdb_uint(const char * p)
+{
+const unsigned char * u = (const unsigned char *)p;
+
+	return u[0] | (u[1] << 8) | (u[2] << 16) | ((unsigned int)u[3] << 24);
+}
+
+unsigned int cdb_hash(const char * key, size_t len)
+{
+unsigned int h = 5381;
+
+	while(len-- > 0)
+		h = ((h << 5) + h) ^ (unsigned char)*key++;
+	return h;
+}
+
+int cdb_open(cdb * c, char * path)
+{
+	c->map = map_file(path, &c->size);
+	if(c->map == NULL || c->size < 2048) {
+		c->map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* the data of key, NULL if it isn't there */
+char * cdb_find(cdb * c, const char * key, size_t len, size_t * dlen)
+{
+unsigned int h, hpos, hslots, slot, i, pos, klen, dl;
+const char * p;
+
+	if(c->map == NULL)
+		return NULL;
+	h = cdb_hash(key, len);
+	hpos = cdb_uint(c->map + (h & 255) * 8);
+	hslots = cdb_uint(c->map + (h & 255) * 8 + 4);
+	if(hslots == 0 || hpos > c->size || hslots > (c->size - hpos) / 8)
+		return NULL;
+	slot = (h >> 8) % hslots;
+	for(i = 0; i < hslots; i++) {
+		p = c->map + hpos + slot * 8;
+		pos = cdb_uint(p + 4);
+		if(pos == 0)
+			return NULL;
+		if(cdb_uint(p) == h && pos <= c->size - 8) {
+			klen = cdb_uint(c->map + pos);
+			dl = cdb_uint(c->map + pos + 4);
+			if(klen == len && klen <= c->size - pos - 8 && dl <= c->size - pos - 8 - klen &&
+				memcmp(c->map + pos + 8, key, len) == 0) {
+				*dlen = dl;
+				return c->map + pos + 8 + klen;
+			}
+		}
+		if(++slot == hslots)
+			slot = 0;
+	}
+	return NULL;
+}
+
+/* the tenants of autorespond --cdb, and their templates */
+static cdb config_cdb;
+
+
 /****************************************************************
 ** A wrapper for qmail-queue
-** borrowed from djb                   */
+** borrowed from djb
+** the reply is streamed into qmail-queue as it is composed:
+** qmail_queue_open() starts it, qq_write() and qq_writev() add to
+** the message and send_message() hands over the envelope.
+** small pieces are copied into buf, qq_ref() queues memory that
+** stays put (the template, a mapped message) without copying it;
+** both go out together in one writev() */
+
+#define QQ_BUFFER_SIZE 16384
+#define QQ_IOV 64
+
+typedef struct _qmail_queue {
+	pid_t pid;
+	int msgfd;				/*message pipe*/
+	int envfd;				/*envelope pipe*/
+	int error;
+	unsigned long bytes;			/*message bytes written*/
+	int niov;				/*pieces waiting in iov*/
+	struct iovec iov[QQ_IOV];
+	size_t len;				/*bytes of buf in use*/
+	char buf[QQ_BUFFER_SIZE];
+} qmail_queue;
+
+/* write all of an iovec array, retrying short writes */
+int writev_all(int fd, struct iovec * iov, int iovcnt)
+{
+ssize_t w;
+
+	while(iovcnt > 0) {
+		w = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if(w == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		while(iovcnt > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
 
-int send_message(char * msg, char * from, char ** recipients, int num_recipients)
+void qq_flush(qmail_queue * qq)
+{
+	if(qq->niov > 0 && !qq->error && writev_all(qq->msgfd, qq->iov, qq->niov) == -1)
+		qq->error = errno;
+	qq->niov = 0;
+	qq->len = 0;
+}
+
+/* queue memory that stays valid until the next qq_flush() */
+void qq_ref(qmail_queue * qq, const char * p, size_t n)
+{
+	if(n == 0)
+		return;
+	if(qq->niov == QQ_IOV)
+		qq_flush(qq);
+	qq->iov[qq->niov].iov_base = (char *)p;
+	qq->iov[qq->niov].iov_len = n;
+	qq->niov++;
+	qq->bytes += n;
+}
+
+/* write several buffers, large ones go straight to the pipe */
+void qq_writev(qmail_queue * qq, struct iovec * iov, int iovcnt)
 {
-/*	...Adds Date:
-	...Adds Message-Id:*/
-int r;
-int wstat;
 int i;
+
+	for(i = 0; i < iovcnt; i++)
+		qq->bytes += iov[i].iov_len;
+	qq_flush(qq);
+	if(!qq->error && writev_all(qq->msgfd, iov, iovcnt) == -1)
+		qq->error = errno;
+}
+
+void qq_write(qmail_queue * qq, const char * p, size_t n)
+{
+struct iovec * last;
+
+	if(qq->len + n > sizeof(qq->buf) || qq->niov == QQ_IOV) {
+		qq_flush(qq);
+		if(n > sizeof(qq->buf)) {
+			struct iovec iov;
+
+			iov.iov_base = (char *)p;
+			iov.iov_len = n;
+			qq_writev(qq, &iov, 1);
+			return;
+		}
+	}
+	memcpy(qq->buf + qq->len, p, n);
+	last = qq->niov > 0 ? &qq->iov[qq->niov - 1] : NULL;
+	if(last != NULL && (char *)last->iov_base + last->iov_len == qq->buf + qq->len) {
+		/*right after the last copied piece*/
+		last->iov_len += n;
+		qq->bytes += n;
+	} else
+		qq_ref(qq, qq->buf + qq->len, n);
+	qq->len += n;
+}
+
+#define qq_puts(qq, s)	qq_write((qq), (s), strlen(s))
+
+int qmail_queue_open(qmail_queue * qq, char * from, char * recipient)
+{
 struct tm * dt;
-unsigned long msgwhen;
-FILE * fdm;
-FILE * fde;
-pid_t pid;
+time_t msgwhen;
 int pim[2];				/*message pipe*/
 int pie[2];				/*envelope pipe*/
-FILE *mfp;
-char msg_buffer[256];
+char head[256];
+
+	/*a qmail-queue that dies must not take us with it*/
+	signal(SIGPIPE, SIG_IGN);
 
 	/*open a pipe to qmail-queue*/
 	if(pipe(pim)==-1 || pipe(pie)==-1) {
-		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: %s.\n", from, recipients[0], strerror(errno));
+		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: %s.\n", from, recipient, strerror(errno));
 		return -1;
 	}
-	pid = vfork();
-	if(pid == -1) {
+	qq->pid = vfork();
+	if(qq->pid == -1) {
 		/*failure*/
-		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: vfork failed - %s.\n", from, recipients[0], strerror(errno));
+		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: vfork failed - %s.\n", from, recipient, strerror(errno));
 		return -1;
 	}
-	if(pid == 0) {
+	if(qq->pid == 0) {
 		/*I am the child*/
 		close(pim[1]);
 		close(pie[1]);
 		/*switch the pipes to fd 0 and 1
 		  pim[0] goes to 0 (stdin)...the message*/
 		if(fcntl(pim[0],F_GETFL,0) == -1) {
-			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to get status flags for message pipe.\n", from, recipients[0]);
+			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to get status flags for message pipe.\n", from, recipient);
 			_exit(120);
 		}
 		close(0);
 		if(fcntl(pim[0],F_DUPFD,0)==-1) {
-			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to duplicate message pipe descriptor.\n", from, recipients[0]);
+			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to duplicate message pipe descriptor.\n", from, recipient);
 			_exit(120);
 		}
 		close(pim[0]);
 		/*pie[0] goes to 1 (stdout)*/
 		if(fcntl(pie[0],F_GETFL,0) == -1) {
-			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to get status flags for envelope pipe.\n", from, recipients[0]);
+			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to get status flags for envelope pipe.\n", from, recipient);
 			_exit(120);
 		}
 		close(1);
 		if(fcntl(pie[0],F_DUPFD,1)==-1) {
-			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to duplicate envelope pipe descriptor.\n", from, recipients[0]);
+			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to duplicate envelope pipe descriptor.\n", from, recipient);
 			_exit(120);
 		}
 		close(pie[0]);
 		if(chdir(QMAIL_LOCATION) == -1) {
-			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to change to qmail directory.\n", from, recipients[0]);
+			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to change to qmail directory.\n", from, recipient);
 			_exit(120);
 		}
 		execv(*binqqargs,binqqargs);
@@ -419,64 +846,66 @@ char msg_buffer[256];
 	}
 
 	/*I am the parent*/
-	fdm = fdopen(pim[1],"wb");					/*updating*/
-	fde = fdopen(pie[1],"wb");
-	if(fdm==NULL || fde==NULL) {
-		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to open pipe streams.\n", from, recipients[0]);
-		return -1;
-	}
 	close(pim[0]);
 	close(pie[0]);
+	qq->msgfd = pim[1];
+	qq->envfd = pie[1];
+	qq->error = 0;
+	qq->bytes = 0;
+	qq->niov = 0;
+	qq->len = 0;
 
-	/*prepare to add date and message-id*/
-	msgwhen = time(NULL);
-	dt = gmtime((long *)&msgwhen);
 	/*start outputting to qmail-queue
+	  ...Adds Date:
+	  ...Adds Message-Id:
 	  date is in 822 format
 	 */
-	fprintf(fdm,"Date: %u %s %u %02u:%02u:%02u -0000\nMessage-ID: <%lu.%u.autorespond@%s>\n"
-		,dt->tm_mday,montab[dt->tm_mon],dt->tm_year+1900,dt->tm_hour,dt->tm_min,dt->tm_sec,msgwhen,getpid(),getenv("LOCAL") );
-
-	mfp = fopen( msg, "rb" );
-
-	while ( fgets( msg_buffer, sizeof(msg_buffer), mfp ) != NULL )
-	{
-		fprintf(fdm,"%s",msg_buffer);
-	}
-
-	fclose(mfp);
-
-	fclose(fdm);
-
-
-	/*send the envelopes*/
+	msgwhen = time(NULL);
+	dt = gmtime(&msgwhen);
+	snprintf(head, sizeof(head), "Date: %u %s %u %02u:%02u:%02u -0000\nMessage-ID: <%lu.%u.autorespond@%s>\n"
+		,dt->tm_mday,montab[dt->tm_mon],dt->tm_year+1900,dt->tm_hour,dt->tm_min,dt->tm_sec,(unsigned long)msgwhen,getpid(),getenv("LOCAL") );
+	qq_puts(qq, head);
+	return 0;
+}
 
-	fprintf(fde,"F%s",from);
-	if(fwrite("",1,1,fde) != 1) {					/*write a null char*/
-		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to write envelope separator.\n", from, recipients[0]);
-		fclose(fde);
-		return -1;
-	}
+int send_message(qmail_queue * qq, char * from, char ** recipients, int num_recipients)
+{
+int r;
+int wstat;
+int i;
+char * env;
+size_t len;
+
+	qq_flush(qq);
+	close(qq->msgfd);
+
+	/*send the envelopes: F from, T each recipient, each followed by a null char, then a null char*/
+	len = strlen(from) + 3;
+	for(i=0;i<num_recipients;i++)
+		len += strlen(recipients[i]) + 2;
+	env = (char *)safe_malloc(len);
+	len = 0;
+	env[len++] = 'F';
+	strcpy(env + len, from);
+	len += strlen(from) + 1;
 	for(i=0;i<num_recipients;i++) {
-		fprintf(fde,"T%s",recipients[i]);
-		if(fwrite("",1,1,fde) != 1) {					/*write a null char*/
-			fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to write recipient separator.\n", from, recipients[0]);
-			fclose(fde);
-			return -1;
-		}
+		env[len++] = 'T';
+		strcpy(env + len, recipients[i]);
+		len += strlen(recipients[i]) + 1;
 	}
-	if(fwrite("",1,1,fde) != 1) {					/*write a null char*/
-		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to write final separator.\n", from, recipients[0]);
-		fclose(fde);
-		return -1;
+	env[len++] = '\0';
+	if(!qq->error && write(qq->envfd, env, len) != (ssize_t)len) {
+		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed to write envelope.\n", from, recipients[0]);
+		qq->error = errno ? errno : EPIPE;
 	}
-	fclose(fde);
+	free(env);
+	close(qq->envfd);
 
 	/*wait for qmail-queue to close*/
 	do {
-		r = wait(&wstat);
-	} while ((r != pid) && ((r != -1) || (errno == EINTR)));
-	if(r != pid) {
+		r = waitpid(qq->pid, &wstat, 0);
+	} while ((r == -1) && (errno == EINTR));
+	if(r != qq->pid) {
 		/*failed while waiting for qmail-queue*/
 		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: Failed while waiting for qmail-queue.\n", from, recipients[0]);
 		return -1;
@@ -494,6 +923,10 @@ char msg_buffer[256];
 		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: qmail-queue exited with status %d.\n", from, recipients[0], wstat >> 8);
 		return -1;
 	}
+	if(qq->error) {
+		fprintf(stderr, "AUTORESPOND: Reply failed to send from %s to %s: %s.\n", from, recipients[0], strerror(qq->error));
+		return -1;
+	}
 	fprintf(stderr, "AUTORESPOND: Reply sent from %s to %s.\n", from, recipients[0]);
 	return 0;
 }
@@ -501,333 +934,3435 @@ char msg_buffer[256];
 /****************************************************************
 ** reading header and break it down to it's tag and contet
    joins continued headers, stops on start of body  matthias@mhcsoftware.de
+   one pass over the lines, nothing is copied or allocated per header.
+   check, if given, sees each header as soon as it is complete; reading
+   stops there (returning 1) if it says so
 */
 
-void read_headers( FILE *fp )
+int read_headers( input *in, int (*check)( headers * ) )
 {
-	char h_buffer[HR_BUFFER_SIZE+1];
-	char *ptr;
-	int  len;
+	char *line, *ptr, *end;
+	size_t line_len, start, block_len;
+	int hold = in->hold;
+	int stopped = 0;
 	headers *act_header = (headers *)NULL;
 
+	header_count = 0;
+	/* keep the lines in place until the block is done */
+	in->hold = 1;
+	start = in->pos;
 
-	while ( fgets( h_buffer, HR_BUFFER_SIZE, fp ) != NULL )
+	while ( (line_len = input_line( in, &line )) > 0 )
 	{
-		ptr = h_buffer;
+		/* the header before this line is complete, check it */
+		if ( check != NULL && act_header != (headers *)NULL && *line != ' ' && *line != '\t' )
+		{
+			header_base = in->base + start;
+			if ( check( act_header ) )
+			{
+				stopped = 1;
+				break;
+			}
+			act_header = (headers *)NULL;
+		}
 
-		if ( *ptr == '\n' )
+		if ( *line == '\n' || (*line == '\r' && line_len > 1 && line[1] == '\n') )
 			break;
 
-		switch( *ptr )
+		switch( *line )
 		{
 		case ' ' :
 		case '\t' : /* header continued */
-			if (act_header == NULL) {
-				/* Invalid header continuation without previous header */
-				continue;
-			} else {
-				char* sanitized_continuation;
-
-				sanitized_continuation = sanitize_header_content(ptr);
-				if (!sanitized_continuation) {
-					continue;
-				}
-
-				len = strlen( sanitized_continuation ) + strlen(act_header->content);
-				if (len > 8192) { /* Prevent excessive header length */
-					free(sanitized_continuation);
-					continue;
-				}
-
-				act_header->content = safe_realloc( act_header->content, len + 1 );
-				strncat( act_header->content, sanitized_continuation, len );
-				act_header->content[len] = '\0';
-
-				free(sanitized_continuation);
-
-				/* Strip trailing newlines */
-				len = strlen(act_header->content);
-				while (len > 0 && (act_header->content[len-1] == '\n' || act_header->content[len-1] == '\r')) {
-					act_header->content[len-1] = '\0';
-					len--;
-				}
-			}
+			if ( act_header != (headers *)NULL )
+				act_header->raw_len = line + line_len - in->base - start - act_header->raw;
 			break;
 		default :
-			if ( act_header != (headers *)NULL )
-			{
-				act_header->next = (headers*)safe_malloc( sizeof(headers) );
-				act_header       = act_header->next;
-			}
-			else
-				header = act_header = (headers*)safe_malloc( sizeof(headers) );
+			act_header = (headers *)NULL;
+			end = line + line_len;
+			for ( ptr = line; ptr < end && *ptr != ' ' && *ptr != '\t' && *ptr != ':'; ptr++ )
+				;
 
-			act_header->next = (headers *)NULL;
-
-			while( *ptr != ' ' && *ptr != '\t' && *ptr != ':' && *ptr != '\0' )
-				ptr++;
-
-			/* strip a possible : */
-			len = ( *(ptr-1) == ':' ) ? ptr - h_buffer - 1 : ptr - h_buffer;
+			if ( !validate_header_tag( line, ptr - line ) )
+				/* invalid header tag, skip this header and its continuations */
+				break;
 
-			/* Validate header tag */
+			if ( header_count == header_size )
 			{
-				char temp_tag[257];
-				char* sanitized_content;
-
-				if (len > 256) {
-					/* Header tag too long, skip this header */
-					act_header = act_header->next ? act_header->next : header;
-					continue;
-				}
-
-				strncpy(temp_tag, h_buffer, len);
-				temp_tag[len] = '\0';
-
-				if (!validate_header_tag(temp_tag)) {
-					/* Invalid header tag, skip this header */
-					act_header = act_header->next ? act_header->next : header;
-					continue;
-				}
-
-				/* skip whitspaces and colon */
-				while( *ptr == ' ' || *ptr == '\t' || *ptr == ':' )
-					ptr++;
-
-				act_header->tag = (char*)safe_malloc( len + 1 );
-				strncpy( act_header->tag, h_buffer, len );
-				act_header->tag[len] = '\0';
-
-				sanitized_content = sanitize_header_content(ptr);
-				if (!sanitized_content) {
-					/* Invalid header content, use empty string */
-					act_header->content = (char*)safe_malloc(1);
-					act_header->content[0] = '\0';
-				} else {
-					act_header->content = (char*)safe_malloc( strlen( sanitized_content ) + 1 );
-					strcpy( act_header->content, sanitized_content );
-					free(sanitized_content);
-				}
-
-				/* Strip trailing newlines */
-				len = strlen(act_header->content);
-				while (len > 0 && (act_header->content[len-1] == '\n' || act_header->content[len-1] == '\r')) {
-					act_header->content[len-1] = '\0';
-					len--;
-				}
+				header_size = header_size ? header_size * 2 : 64;
+				header = (headers *)safe_realloc( header, header_size * sizeof(headers) );
 			}
+			act_header = &header[header_count++];
+			act_header->tag = line - in->base - start;
+			act_header->tag_len = ptr - line;
+			act_header->hash = header_hash( line, ptr - line );
 
+			/* skip whitspaces and colon */
+			while( ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == ':') )
+				ptr++;
+			act_header->raw = ptr - in->base - start;
+			act_header->raw_len = end - ptr;
+			act_header->unfolded = 0;
 			break;
 		}
 	}
-}
-
-
-
-/*********************************************************
-** find string in string - ignore case **/
-
-char *strcasestr2( char *_s1, char *_s2 )
-{
-	char *s1;
-	char *s2;
-	char *ptr;
-	char *result = NULL;
-
-	s1 = strdup(_s1);
-	if (s1 == NULL) {
-		return NULL;
+	if ( check != NULL && act_header != (headers *)NULL && !stopped && line_len == 0 )
+	{
+		/* the header block ran to the end of the message */
+		header_base = in->base + start;
+		stopped = check( act_header );
 	}
 
-	s2 = strdup(_s2);
-	if (s2 == NULL) {
-		free(s1);
-		return NULL;
+	/* a mapped message ends in a newline, which leaves room to terminate
+	   every content in place; other input gets a copy with a byte to
+	   spare, the last content may already be terminated in it */
+	block_len = in->pos - start;
+	if ( in->mapped )
+		header_base = in->base + start;
+	else
+	{
+		if ( block_len + 1 > header_block_size )
+		{
+			header_block_size = block_len + 1;
+			header_block = (char *)safe_realloc( header_block, header_block_size );
+		}
+		memcpy( header_block, in->base + start, block_len );
+		header_block[block_len] = '\0';
+		header_base = header_block;
 	}
+	in->hold = hold;
+	index_headers();
+	return stopped;
+}
 
-	for ( ptr = s1; *ptr != '\0'; ptr++ )
-		*ptr = tolower( *ptr );
-
-	for ( ptr = s2; *ptr != '\0'; ptr++ )
-		*ptr = tolower( *ptr );
 
-	ptr = strstr( s1, s2 );
 
-	if ( ptr != (char *)NULL )
-		result = _s1 + (ptr - s1);
+/*********************************************************
+** header name hash, FNV-1a over the case folded name */
 
-	free(s1);
-	free(s2);
+unsigned int header_hash( const char *tag, size_t len )
+{
+	unsigned int h = 2166136261U;
+	size_t i;
 
-	return result;
+	for ( i = 0; i < len; i++ )
+		h = (h ^ (unsigned char)tolower( (unsigned char)tag[i] )) * 16777619U;
+	return h;
 }
 
 
 
-
 /*********************************************************
-** look up header tag in chain and try to find search string
-** returns pointer to contetnt on success other wise NULL */
+** index_headers - chain the headers of each name together and
+** hash the names, after every read_headers() */
 
-char *inspect_headers( char * tag, char *ss )
+void index_headers( void )
 {
-	headers *act_header;
+	unsigned int size, slot;
+	int i, *last;
+	headers *h;
 
-	if (!tag) {
-		return (char *)NULL;
+	for ( size = 64; size < (unsigned int)header_count * 2; size *= 2 )
+		;
+	if ( size > header_table_size )
+	{
+		header_table_size = size;
+		header_table = (int *)safe_realloc( header_table, size * sizeof(int) );
 	}
+	memset( header_table, 0xff, header_table_size * sizeof(int) );
 
-	act_header = header;
-
-	while ( act_header != (headers *)NULL )
+	/* walk backwards so each chain comes out in header order */
+	for ( i = header_count - 1; i >= 0; i-- )
 	{
-		if ( strcasecmp( act_header->tag, tag ) == 0 )
+		h = &header[i];
+		h->next = -1;
+		for ( slot = h->hash & (header_table_size - 1); ; slot = (slot + 1) & (header_table_size - 1) )
 		{
-			if ( ss == (char *)NULL )
-				return act_header->content;
-
-			if ( strcasestr2( act_header->content, ss ) != (char *)NULL )
-				return act_header->content;
-
-			return (char *)NULL;
+			last = &header_table[slot];
+			if ( *last == -1 )
+				break;
+			if ( header[*last].hash == h->hash && header[*last].tag_len == h->tag_len
+				&& strncasecmp( HEADER_TAG(&header[*last]), HEADER_TAG(h), h->tag_len ) == 0 )
+			{
+				h->next = *last;
+				break;
+			}
 		}
-		act_header = act_header->next;
+		*last = i;
 	}
-	return (char *)NULL;
 }
 
 
 
 /*********************************************************
-** returns the content boundary string for this message */
-char *get_content_boundary(void)
-{
-	char *s, *r;
-
-	if ( (s = inspect_headers( "Content-Type", (char *)NULL )) == (char *)NULL)
-		return (char *)NULL;
+** header_find - the first header of that name, or NULL;
+** header_next() gives the ones after it */
 
-	if ( (r = strcasestr2( s, "boundary=" )) == (char *)NULL)
-		return (char *)NULL;
-
-	*(r+strlen(r)-2) = '\0'; /* delete quote at the end */
-
-	return r+10; /* point to first cahr after quote */
+headers *header_find( const char *tag )
+{
+	unsigned int hash, slot;
+	size_t len;
+	headers *h;
+
+	if ( header_count == 0 )
+		return (headers *)NULL;
+	len = strlen( tag );
+	hash = header_hash( tag, len );
+	for ( slot = hash & (header_table_size - 1); header_table[slot] != -1; slot = (slot + 1) & (header_table_size - 1) )
+	{
+		h = &header[header_table[slot]];
+		if ( h->hash == hash && h->tag_len == len && strncasecmp( HEADER_TAG(h), tag, len ) == 0 )
+			return h;
+	}
+	return (headers *)NULL;
 }
 
+#define header_next(h)	((h)->next == -1 ? (headers *)NULL : &header[(h)->next])
+
 
 
 /*********************************************************
-** concat headers to one string for output **/
+** header_content - the unfolded content of a header */
 
-char *return_header( char *tag )
+char *header_content( headers *h )
 {
-	headers *act_header;
-	int len;
-	char *b;
-
-	act_header = header;
-	b     = (char *)safe_malloc( 20 );
-	*b    = '\0';
+	char *raw = header_base + h->raw;
 
-	while ( act_header != (headers *)NULL )
+	if ( !h->unfolded )
 	{
-		if ( (tag != (char *)NULL && strcasecmp(tag,act_header->tag ) == 0) || tag == (char *)NULL )
-		{
-			/* Validate header content before concatenation */
-			if (!act_header->tag || !act_header->content) {
-				act_header = act_header->next;
-				continue;
-			}
-
-			len = strlen( b ) +
-				  strlen( act_header->tag ) + 1 +
-				  strlen( act_header->content );
+		raw[sanitize_header_content( raw, h->raw_len )] = '\0';
+		h->unfolded = 1;
+	}
+	return raw;
+}
 
-			/* Prevent excessive header concatenation */
-			if (len > 16384) {
-				break;
-			}
+int header_is( headers *h, const char *tag )
+{
+	return strlen( tag ) == h->tag_len && strncasecmp( HEADER_TAG(h), tag, h->tag_len ) == 0;
+}
 
-			b = safe_realloc( b, len + 1);
 
-			strcat( b, act_header->tag );
-			strcat( b, ":" );
-			strcat( b, act_header->content );
 
-			b[len] = '\0';
-		}
-		act_header = act_header->next;
-	}
-	return( b );
-}
+/*********************************************************
+** find string in string - ignore case
+** nothing is copied or allocated: blocks of the haystack are checked
+** for the needle's first and last byte at once (SSE2 or AVX2, picked
+** at run time) and only those candidates are compared in full **/
 
+#define FOLD(c)		((unsigned char)(c) | (((unsigned char)(c) - (unsigned)'A' < 26U) << 5))
+#define UNFOLD(c)	(FOLD(c) >= 'a' && FOLD(c) <= 'z' ? FOLD(c) - 32 : FOLD(c))
 
+static int case_equal( const char *a, const char *b, size_t n )
+{
+	size_t i;
 
-/**********************************************************
-** free header chain ***/
+	for ( i = 0; i < n; i++ )
+		if ( FOLD(a[i]) != FOLD(b[i]) )
+			return 0;
+	return 1;
+}
 
-void free_headers(void)
+/* without SIMD: memchr() for the first byte in either case, whichever
+   comes first is a candidate */
+char *casesearch_scalar( const char *hay, size_t hay_len, const char *needle, size_t n )
 {
-	headers *act_header, *tmp_header;
+	unsigned char lo, up, last;
+	const char *end, *at_lo, *at_up, *p;
 
-	act_header = header;
+	if ( n == 0 )
+		return (char *)hay;
+	if ( n > hay_len )
+		return (char *)NULL;
+	lo = FOLD(needle[0]);
+	up = UNFOLD(needle[0]);
+	last = FOLD(needle[n - 1]);
+	end = hay + hay_len - n + 1;		/*candidates start before end*/
+	at_lo = memchr( hay, lo, end - hay );
+	at_up = lo == up ? (char *)NULL : memchr( hay, up, end - hay );
+	while ( at_lo != (char *)NULL || at_up != (char *)NULL )
+	{
+		p = at_up == (char *)NULL || (at_lo != (char *)NULL && at_lo < at_up) ? at_lo : at_up;
+		if ( FOLD(p[n - 1]) == last && case_equal( p + 1, needle + 1, n - 1 ) )
+			return (char *)p;
+		if ( p == at_lo )
+			at_lo = memchr( p + 1, lo, end - p - 1 );
+		else
+			at_up = memchr( p + 1, up, end - p - 1 );
+	}
+	return (char *)NULL;
+}
 
-	while ( act_header != (headers *)NULL )
+#ifdef CASESEARCH_SIMD
+__attribute__((target("sse2")))
+char *casesearch_sse2( const char *hay, size_t hay_len, const char *needle, size_t n )
+{
+	__m128i first_lo, first_up, last_lo, last_up, a, b, eq;
+	unsigned int mask;
+	size_t i;
+
+	if ( n < 2 || n > hay_len )
+		return casesearch_scalar( hay, hay_len, needle, n );
+	first_lo = _mm_set1_epi8( (char)FOLD(needle[0]) );
+	first_up = _mm_set1_epi8( (char)UNFOLD(needle[0]) );
+	last_lo = _mm_set1_epi8( (char)FOLD(needle[n - 1]) );
+	last_up = _mm_set1_epi8( (char)UNFOLD(needle[n - 1]) );
+	for ( i = 0; i + n - 1 + 16 <= hay_len; i += 16 )
 	{
-		free( act_header->tag );
-		free( act_header->content );
-		tmp_header = act_header;
-		act_header = act_header->next;
-		free( tmp_header );
+		a = _mm_loadu_si128( (const __m128i *)(hay + i) );
+		b = _mm_loadu_si128( (const __m128i *)(hay + i + n - 1) );
+		eq = _mm_and_si128( _mm_or_si128( _mm_cmpeq_epi8( a, first_lo ), _mm_cmpeq_epi8( a, first_up ) ),
+			_mm_or_si128( _mm_cmpeq_epi8( b, last_lo ), _mm_cmpeq_epi8( b, last_up ) ) );
+		for ( mask = _mm_movemask_epi8( eq ); mask != 0; mask &= mask - 1 )
+			if ( case_equal( hay + i + __builtin_ctz( mask ) + 1, needle + 1, n - 2 ) )
+				return (char *)hay + i + __builtin_ctz( mask );
 	}
+	return casesearch_scalar( hay + i, hay_len - i, needle, n );
 }
 
+__attribute__((target("avx2")))
+char *casesearch_avx2( const char *hay, size_t hay_len, const char *needle, size_t n )
+{
+	__m256i first_lo, first_up, last_lo, last_up, a, b, eq;
+	unsigned int mask;
+	size_t i;
+
+	if ( n < 2 || n > hay_len )
+		return casesearch_scalar( hay, hay_len, needle, n );
+	first_lo = _mm256_set1_epi8( (char)FOLD(needle[0]) );
+	first_up = _mm256_set1_epi8( (char)UNFOLD(needle[0]) );
+	last_lo = _mm256_set1_epi8( (char)FOLD(needle[n - 1]) );
+	last_up = _mm256_set1_epi8( (char)UNFOLD(needle[n - 1]) );
+	for ( i = 0; i + n - 1 + 32 <= hay_len; i += 32 )
+	{
+		a = _mm256_loadu_si256( (const __m256i *)(hay + i) );
+		b = _mm256_loadu_si256( (const __m256i *)(hay + i + n - 1) );
+		eq = _mm256_and_si256( _mm256_or_si256( _mm256_cmpeq_epi8( a, first_lo ), _mm256_cmpeq_epi8( a, first_up ) ),
+			_mm256_or_si256( _mm256_cmpeq_epi8( b, last_lo ), _mm256_cmpeq_epi8( b, last_up ) ) );
+		for ( mask = _mm256_movemask_epi8( eq ); mask != 0; mask &= mask - 1 )
+			if ( case_equal( hay + i + __builtin_ctz( mask ) + 1, needle + 1, n - 2 ) )
+				return (char *)hay + i + __builtin_ctz( mask );
+	}
+	/*the tail is SSE code, which pays for dirty upper halves*/
+	_mm256_zeroupper();
+	return casesearch_sse2( hay + i, hay_len - i, needle, n );
+}
+#endif
+
+typedef char *(*casesearch_fn)( const char *, size_t, const char *, size_t );
+
+static casesearch_fn casesearch_impl = (casesearch_fn)NULL;
+
+casesearch_fn casesearch_select( void )
+{
+#ifdef CASESEARCH_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return casesearch_avx2;
+	if ( __builtin_cpu_supports( "sse2" ) )
+		return casesearch_sse2;
+#endif
+	return casesearch_scalar;
+}
+
+char *casesearch( const char *hay, size_t hay_len, const char *needle, size_t n )
+{
+	if ( casesearch_impl == (casesearch_fn)NULL )
+		casesearch_impl = casesearch_select();
+	return casesearch_impl( hay, hay_len, needle, n );
+}
+
+char *strcasestr2( char *_s1, char *_s2 )
+{
+	return casesearch( _s1, strlen( _s1 ), _s2, strlen( _s2 ) );
+}
+
+
+
+
+/*********************************************************
+** look up header tag and try to find search string in any of
+** the headers of that name
+** returns pointer to contetnt on success other wise NULL */
+
+char *inspect_headers( char * tag, char *ss )
+{
+	headers *act_header;
+	char *content;
+
+	if (!tag) {
+		return (char *)NULL;
+	}
+
+	for ( act_header = header_find( tag ); act_header != (headers *)NULL; act_header = header_next( act_header ) )
+	{
+		content = header_content( act_header );
+		if ( ss == (char *)NULL )
+			return content;
+
+		if ( strcasestr2( content, ss ) != (char *)NULL )
+			return content;
+	}
+	return (char *)NULL;
+}
+
+
+
+/*********************************************************
+** reply templates
+** the message file may use %{sender}, %{recipient}, %{arsender},
+** %{subject}, %{date} and %{message-id} (the last three of the
+** original message); anything else is copied as it is. a template is
+** parsed once into segments: pieces of its text, which go out straight
+** from its mapping, and the values between them. the segments are kept
+** in "message.cache", next to it, and used for as long as its inode,
+** size and mtime are the same; not being able to write it is no error */
+
+#define TPL_TEXT	0
+#define TPL_SENDER	1
+#define TPL_RECIPIENT	2
+#define TPL_ARSENDER	3
+#define TPL_SUBJECT	4
+#define TPL_DATE	5
+#define TPL_MESSAGE_ID	6
+
+#define TPL_MAGIC	"ARTPL1\n"
+
+static char *tpl_names[] = { "", "sender", "recipient", "arsender", "subject", "date", "message-id", NULL };
+
+typedef struct _segment {
+	unsigned int kind;
+	unsigned int off;			/*of TPL_TEXT in the template*/
+	unsigned int len;
+} segment;
+
+typedef struct _template {
+	const char *text;
+	size_t len;
+	segment *seg;
+	unsigned int count;
+} template;
+
+/* on disk: this, then count segments */
+typedef struct _tpl_cache {
+	char magic[8];
+	unsigned long long ino;
+	unsigned long long size;
+	long long mtime;
+	long long mtime_nsec;
+	unsigned int count;
+} tpl_cache;
+
+/* the values the placeholders of a reply stand for */
+static char *tpl_values[sizeof(tpl_names) / sizeof(tpl_names[0])];
+
+void tpl_parse( template *t )
+{
+	const char *p, *end = t->text + t->len, *close, *text;
+	unsigned int k;
+	size_t n;
+
+	/* at most a text and a value for each "%{" */
+	t->seg = (segment *)safe_malloc( (t->len / 3 + 2) * sizeof(segment) );
+	t->count = 0;
+	for ( text = p = t->text; (p = memchr( p, '%', end - p )) != (char *)NULL; p++ )
+	{
+		if ( end - p < 3 || p[1] != '{' || (close = memchr( p + 2, '}', end - p - 2 )) == (char *)NULL )
+			continue;
+		n = close - (p + 2);
+		for ( k = TPL_SENDER; tpl_names[k] != NULL; k++ )
+			if ( strlen( tpl_names[k] ) == n && strncasecmp( tpl_names[k], p + 2, n ) == 0 )
+				break;
+		if ( tpl_names[k] == NULL )
+			continue;
+		if ( p > text )
+		{
+			t->seg[t->count].kind = TPL_TEXT;
+			t->seg[t->count].off = text - t->text;
+			t->seg[t->count++].len = p - text;
+		}
+		t->seg[t->count].kind = k;
+		t->seg[t->count].off = 0;
+		t->seg[t->count++].len = 0;
+		text = p = close;
+		text++;
+	}
+	if ( end > text )
+	{
+		t->seg[t->count].kind = TPL_TEXT;
+		t->seg[t->count].off = text - t->text;
+		t->seg[t->count++].len = end - text;
+	}
+}
+
+/* the cached segments, if they are of this very template */
+int tpl_cache_read( template *t, const char *path, struct stat *st )
+{
+	tpl_cache c;
+	unsigned int i;
+	int fd, ok = 0;
+
+	if ( (fd = open( path, O_RDONLY )) == -1 )
+		return 0;
+	if ( read( fd, &c, sizeof(c) ) == (ssize_t)sizeof(c) && memcmp( c.magic, TPL_MAGIC, sizeof(c.magic) ) == 0
+		&& c.ino == (unsigned long long)st->st_ino && c.size == (unsigned long long)st->st_size
+		&& c.mtime == (long long)st->st_mtim.tv_sec && c.mtime_nsec == (long long)st->st_mtim.tv_nsec
+		&& c.count <= t->len / 3 + 2 )
+	{
+		t->seg = (segment *)safe_malloc( (c.count + 1) * sizeof(segment) );
+		t->count = c.count;
+		ok = read( fd, t->seg, c.count * sizeof(segment) ) == (ssize_t)(c.count * sizeof(segment));
+		for ( i = 0; ok && i < t->count; i++ )
+			ok = t->seg[i].kind < sizeof(tpl_names) / sizeof(tpl_names[0]) - 1
+				&& t->seg[i].off <= t->len && t->seg[i].len <= t->len - t->seg[i].off;
+		if ( !ok )
+			free( t->seg );
+	}
+	close( fd );
+	return ok;
+}
+
+void tpl_cache_write( template *t, const char *path, struct stat *st )
+{
+	char tmp[PATH_MAX];
+	struct iovec iov[2];
+	tpl_cache c;
+	int fd;
+
+	if ( (size_t)snprintf( tmp, sizeof(tmp), "%s.%u", path, (unsigned int)getpid() ) >= sizeof(tmp) )
+		return;
+	if ( (fd = open( tmp, O_WRONLY | O_CREAT | O_EXCL, 0644 )) == -1 )
+		return;
+	memset( &c, 0, sizeof(c) );
+	memcpy( c.magic, TPL_MAGIC, sizeof(c.magic) );
+	c.ino = st->st_ino;
+	c.size = st->st_size;
+	c.mtime = st->st_mtim.tv_sec;
+	c.mtime_nsec = st->st_mtim.tv_nsec;
+	c.count = t->count;
+	iov[0].iov_base = &c;
+	iov[0].iov_len = sizeof(c);
+	iov[1].iov_base = t->seg;
+	iov[1].iov_len = t->count * sizeof(segment);
+	if ( writev_all( fd, iov, 2 ) == -1 || close( fd ) == -1 || rename( tmp, path ) == -1 )
+		unlink( tmp );
+}
+
+/* map the message file and find its segments; -1 if it can't be read.
+   ":name" is a template kept in the cdb of autorespond --cdb */
+int tpl_load( template *t, char *filename )
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if ( *filename == ':' && config_cdb.map != (char *)NULL )
+	{
+		if ( (t->text = cdb_find( &config_cdb, filename, strlen( filename ), &t->len )) == (char *)NULL )
+			return -1;
+		tpl_parse( t );
+		return 0;
+	}
+	if ( (t->text = map_file( filename, &t->len )) == (char *)NULL || stat( filename, &st ) == -1 )
+		return -1;
+	if ( (size_t)snprintf( path, sizeof(path), "%s.cache", filename ) >= sizeof(path) )
+	{
+		tpl_parse( t );
+		return 0;
+	}
+	if ( !tpl_cache_read( t, path, &st ) )
+	{
+		tpl_parse( t );
+		tpl_cache_write( t, path, &st );
+	}
+	return 0;
+}
+
+/* a value of the original message's headers, without the leading blanks */
+char *tpl_header( char *tag )
+{
+	char *v = inspect_headers( tag, (char *)NULL );
+
+	return v == (char *)NULL ? "" : v + strspn( v, " \t" );
+}
+
+/* write the template out, its text from where it is */
+void tpl_render( qmail_queue *qq, template *t )
+{
+	segment *s;
+	char *v;
+
+	for ( s = t->seg; s < t->seg + t->count; s++ )
+	{
+		if ( s->kind == TPL_TEXT )
+			qq_ref( qq, t->text + s->off, s->len );
+		else if ( (v = tpl_values[s->kind]) != (char *)NULL )
+			qq_write( qq, v, strlen( v ) );
+	}
+}
+
+
+/*********************************************************
+** quoting the original message
+** the message is walked in one pass: multipart bodies (nested up to
+** MIME_DEPTH) are searched for their next delimiter with a Horspool
+** skip table, so parts that are not quoted are stepped over without
+** being looked at line by line or kept in memory. the first text/plain
+** part that is not an attachment (any text at the top level) is quoted,
+** decoded from quoted-printable or base64 in place */
+
+#define MIME_DEPTH	8
+#define MIME_BOUNDARY	70	/*longest boundary RFC 2046 allows*/
+
+/* how much of the original is quoted, at most: bytes of quote (with
+   the "> ") and lines; 0 is no limit. $AUTORESPOND_QUOTE_BYTES and
+   $AUTORESPOND_QUOTE_LINES override them. what doesn't fit is not read */
+#define QUOTE_BYTES	65536
+#define QUOTE_LINES	0
+#define QUOTE_TRUNCATED	"\n[... the rest of the original message was cut ...]\n"
+
+#define MIME_IDENTITY	0
+#define MIME_QP		1
+#define MIME_BASE64	2
+
+typedef struct _boundary {
+	char pattern[MIME_BOUNDARY + 4];	/*"\n--" boundary*/
+	size_t len;				/*of pattern*/
+	unsigned char skip[256];		/*Horspool shifts*/
+} boundary;
+
+typedef struct _quoter {
+	qmail_queue *qq;
+	input *in;
+	int encoding;
+	int bol;				/*at the start of a quoted line*/
+	unsigned int acc;			/*base64 bits not yet out*/
+	int bits;
+	size_t bytes_left;			/*of the budget*/
+	unsigned long lines_left;
+	int truncated;				/*the budget ran out*/
+} quoter;
+
+/* a parameter of a structured header, as in boundary="abc"; 0 if absent */
+int mime_param( const char *value, const char *name, char *buf, size_t size )
+{
+	size_t name_len = strlen( name ), n;
+	const char *p = value;
+
+	while ( (p = strchr( p, ';' )) != (char *)NULL )
+	{
+		p++;
+		p += strspn( p, " \t" );
+		if ( strncasecmp( p, name, name_len ) != 0 )
+			continue;
+		p += name_len;
+		p += strspn( p, " \t" );
+		if ( *p++ != '=' )
+			continue;
+		p += strspn( p, " \t" );
+		for ( n = 0; ; p++ )
+		{
+			if ( *p == '"' && n == 0 && *(p + 1) != '\0' )
+			{
+				/* quoted string, \ quotes the next character */
+				for ( p++; *p != '\0' && *p != '"'; p++ )
+				{
+					if ( *p == '\\' && *(p + 1) != '\0' )
+						p++;
+					if ( n + 1 < size )
+						buf[n++] = *p;
+				}
+				break;
+			}
+			if ( *p == '\0' || *p == ';' || *p == ' ' || *p == '\t' )
+				break;
+			if ( n + 1 < size )
+				buf[n++] = *p;
+		}
+		buf[n] = '\0';
+		return n > 0;
+	}
+	return 0;
+}
+
+/* the delimiter of a multipart Content-Type, 0 if it isn't one */
+int mime_boundary( const char *type, boundary *b )
+{
+	char value[MIME_BOUNDARY + 1];
+	size_t i;
+
+	type += strspn( type, " \t" );
+	if ( strncasecmp( type, "multipart/", 10 ) != 0 || !mime_param( type, "boundary", value, sizeof(value) ) )
+		return 0;
+	b->len = snprintf( b->pattern, sizeof(b->pattern), "\n--%s", value );
+	for ( i = 0; i < 256; i++ )
+		b->skip[i] = b->len;
+	for ( i = 0; i + 1 < b->len; i++ )
+		b->skip[(unsigned char)b->pattern[i]] = b->len - 1 - i;
+	return 1;
+}
+
+char *horspool_find( boundary *b, const char *hay, size_t n )
+{
+	size_t i = 0, m = b->len;
+	unsigned char c;
+
+	while ( i + m <= n )
+	{
+		c = hay[i + m - 1];
+		if ( c == (unsigned char)b->pattern[m - 1] && memcmp( hay + i, b->pattern, m - 1 ) == 0 )
+			return (char *)hay + i;
+		i += b->skip[c];
+	}
+	return (char *)NULL;
+}
+
+/* is there a delimiter line (--boundary, maybe --boundary--, but not
+   a longer boundary) at p? */
+int mime_delimiter_at( boundary *b, const char *p, size_t n )
+{
+	size_t k = b->len - 1;
+
+	if ( n < k || memcmp( p, b->pattern + 1, k ) != 0 )
+		return 0;
+	if ( n == k || p[k] == '\r' || p[k] == '\n' || p[k] == ' ' || p[k] == '\t' )
+		return 1;
+	return n > k + 1 && p[k] == '-' && p[k + 1] == '-';
+}
+
+/* move the input to the next delimiter line of b; 0 at the end */
+int mime_skip( input *in, boundary *b )
+{
+	char *p, *hit = (char *)NULL;
+	size_t n, off, start;
+
+	/* right at the start of the body there is no newline before it */
+	while ( in->len - in->pos < b->len && input_fill( in ) > 0 )
+		;
+	if ( mime_delimiter_at( b, in->base + in->pos, in->len - in->pos ) )
+		return 1;
+
+	for ( ;; )
+	{
+		p = in->base + in->pos;
+		n = in->len - in->pos;
+		for ( start = 0; (hit = horspool_find( b, p + start, n - start )) != (char *)NULL; start = off )
+		{
+			off = hit + 1 - p;
+			/* the two bytes after the boundary tell, wait for them */
+			if ( off + b->len + 1 > n && !in->eof )
+				break;
+			if ( mime_delimiter_at( b, p + off, n - off ) )
+			{
+				in->pos += off;
+				return 1;
+			}
+		}
+		/* what has been searched goes, but for a possible start of it */
+		if ( hit != (char *)NULL )
+			in->pos += hit - p;
+		else if ( n >= b->len )
+			in->pos += n - (b->len - 1);
+		if ( input_fill( in ) == 0 && hit == (char *)NULL )
+		{
+			in->pos = in->len;
+			return 0;
+		}
+	}
+}
+
+/* is the line a delimiter of one of the open multiparts? */
+int mime_delimiter( boundary *stack, int depth, const char *line, size_t len )
+{
+	int i;
+
+	if ( len < 2 || line[0] != '-' || line[1] != '-' )
+		return 0;
+	for ( i = 0; i < depth; i++ )
+		if ( mime_delimiter_at( &stack[i], line, len ) )
+			return 1;
+	return 0;
+}
+
+/* the budget from the environment, or the defaults */
+void quote_budget( quoter *q )
+{
+	char *e, *end;
+	unsigned long v;
+
+	q->bytes_left = QUOTE_BYTES ? QUOTE_BYTES : (size_t)-1;
+	if ( (e = getenv( "AUTORESPOND_QUOTE_BYTES" )) != (char *)NULL && *e != '\0' )
+	{
+		v = strtoul( e, &end, 10 );
+		if ( *end == '\0' )
+			q->bytes_left = v ? (size_t)v : (size_t)-1;
+	}
+	q->lines_left = QUOTE_LINES ? QUOTE_LINES : (unsigned long)-1;
+	if ( (e = getenv( "AUTORESPOND_QUOTE_LINES" )) != (char *)NULL && *e != '\0' )
+	{
+		v = strtoul( e, &end, 10 );
+		if ( *end == '\0' )
+			q->lines_left = v ? v : (unsigned long)-1;
+	}
+	q->truncated = 0;
+}
+
+/* quote decoded text, "> " at the start of every line, as far as the
+   budget goes. a mapped message (and what was decoded in it) stays
+   put, so isn't copied */
+void quote_bytes( quoter *q, const char *p, size_t n )
+{
+	const char *nl;
+	size_t seg, prefix;
+
+	while ( n > 0 )
+	{
+		nl = memchr( p, '\n', n );
+		seg = nl ? (size_t)(nl + 1 - p) : n;
+		prefix = q->bol ? 2 : 0;
+		if ( q->lines_left == 0 || prefix + seg > q->bytes_left )
+		{
+			/* what fits of the line, if anything but its "> " does */
+			q->truncated = 1;
+			if ( q->lines_left == 0 || q->bytes_left <= prefix )
+				return;
+			seg = q->bytes_left - prefix;
+			nl = (char *)NULL;
+		}
+		if ( q->bol )
+			qq_ref( q->qq, "> ", 2 );
+		q->bytes_left -= prefix + seg;
+		if ( nl != (char *)NULL && q->lines_left != (unsigned long)-1 )
+			q->lines_left--;
+		if ( q->in->mapped )
+			qq_ref( q->qq, p, seg );
+		else
+			qq_write( q->qq, p, seg );
+		q->bol = nl != (char *)NULL;
+		p += seg;
+		n -= seg;
+	}
+}
+
+int hex_value( int c )
+{
+	if ( c >= '0' && c <= '9' )
+		return c - '0';
+	c = FOLD(c);
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* decode a line of quoted-printable in place, a soft line break
+   (= at the end) leaves the newline out */
+size_t qp_decode( char *line, size_t len )
+{
+	size_t i = 0, j = 0, k;
+	int hi, lo;
+
+	while ( i < len )
+	{
+		if ( line[i] != '=' )
+		{
+			line[j++] = line[i++];
+			continue;
+		}
+		for ( k = i + 1; k < len && (line[k] == ' ' || line[k] == '\t' || line[k] == '\r' || line[k] == '\n'); k++ )
+			;
+		if ( k == len )
+			break;
+		if ( i + 2 < len && (hi = hex_value( line[i + 1] )) >= 0 && (lo = hex_value( line[i + 2] )) >= 0 )
+		{
+			line[j++] = (char)(hi * 16 + lo);
+			i += 3;
+		} else
+			line[j++] = line[i++];
+	}
+	return j;
+}
+
+/* decode a line of base64 in place, carrying odd bits to the next */
+size_t base64_decode( quoter *q, char *line, size_t len )
+{
+	size_t i, j = 0;
+	int c, v;
+
+	for ( i = 0; i < len; i++ )
+	{
+		c = (unsigned char)line[i];
+		if ( c >= 'A' && c <= 'Z' )
+			v = c - 'A';
+		else if ( c >= 'a' && c <= 'z' )
+			v = c - 'a' + 26;
+		else if ( c >= '0' && c <= '9' )
+			v = c - '0' + 52;
+		else if ( c == '+' )
+			v = 62;
+		else if ( c == '/' )
+			v = 63;
+		else
+			continue;
+		q->acc = (q->acc << 6) | v;
+		q->bits += 6;
+		if ( q->bits >= 8 )
+		{
+			q->bits -= 8;
+			line[j++] = (char)(q->acc >> q->bits);
+		}
+	}
+	return j;
+}
+
+/* quote the body of the current entity up to a delimiter or the end */
+void quote_part( quoter *q, boundary *stack, int depth )
+{
+	char *line, *te;
+	size_t len;
+
+	q->encoding = MIME_IDENTITY;
+	if ( (te = inspect_headers( "Content-Transfer-Encoding", (char *)NULL )) != (char *)NULL )
+	{
+		if ( strcasestr2( te, "quoted-printable" ) != (char *)NULL )
+			q->encoding = MIME_QP;
+		else if ( strcasestr2( te, "base64" ) != (char *)NULL )
+			q->encoding = MIME_BASE64;
+	}
+	q->acc = 0;
+	q->bits = 0;
+
+	while ( (len = input_line( q->in, &line )) > 0 )
+	{
+		if ( mime_delimiter( stack, depth, line, len ) )
+			break;
+		if ( q->encoding == MIME_QP )
+			len = qp_decode( line, len );
+		else if ( q->encoding == MIME_BASE64 )
+			len = base64_decode( q, line, len );
+		quote_bytes( q, line, len );
+		if ( q->truncated )
+			break;
+	}
+	if ( !q->bol )
+		qq_write( q->qq, "\n", 1 );
+	if ( q->truncated )
+		qq_puts( q->qq, QUOTE_TRUNCATED );
+}
+
+/* is the entity whose headers were just read the text to quote? */
+int mime_quotable( int depth )
+{
+	char *type, *disposition;
+
+	type = inspect_headers( "Content-Type", (char *)NULL );
+	if ( type == (char *)NULL )
+		return 1;			/*text/plain by default*/
+	type += strspn( type, " \t" );
+	if ( depth == 0 )
+		return strncasecmp( type, "text/", 5 ) == 0;
+	disposition = inspect_headers( "Content-Disposition", (char *)NULL );
+	if ( disposition != (char *)NULL && strcasestr2( disposition, "attachment" ) != (char *)NULL )
+		return 0;
+	return strncasecmp( type, "text/plain", 10 ) == 0;
+}
+
+/* walk the message, whose own headers have been read, and quote it */
+void quote_original( qmail_queue *qq, input *in )
+{
+	boundary stack[MIME_DEPTH];
+	quoter q;
+	char *type, *line;
+	size_t len;
+	int depth = 0;
+
+	q.qq = qq;
+	q.in = in;
+	q.bol = 1;
+	quote_budget( &q );
+	for ( ;; )
+	{
+		type = inspect_headers( "Content-Type", (char *)NULL );
+		if ( type != (char *)NULL && depth < MIME_DEPTH && mime_boundary( type, &stack[depth] ) )
+			depth++;
+		else if ( mime_quotable( depth ) )
+		{
+			quote_part( &q, stack, depth );
+			return;
+		} else if ( depth == 0 )
+			return;
+
+		/* on to the next part of the innermost multipart, leaving
+		   the ones that end on the way */
+		for ( ;; )
+		{
+			if ( !mime_skip( in, &stack[depth - 1] ) )
+				return;
+			len = input_line( in, &line );
+			if ( len < stack[depth - 1].len + 1 || memcmp( line + stack[depth - 1].len - 1, "--", 2 ) != 0 )
+				break;
+			if ( --depth == 0 )
+				return;
+		}
+		read_headers( in, NULL );
+	}
+}
+
+
+
+/*********************************************************
+** concat headers to one string for output **/
+
+char *return_header( char *tag )
+{
+	headers *act_header;
+	int len;
+	char *b, *content;
+
+	b     = (char *)safe_malloc( 20 );
+	*b    = '\0';
+	len   = 0;
+
+	for ( act_header = header; act_header < header + header_count; act_header++ )
+	{
+		if ( tag == (char *)NULL || header_is( act_header, tag ) )
+		{
+			content = header_content( act_header );
+
+			/* Prevent excessive header concatenation */
+			if (len + act_header->tag_len + 1 + strlen( content ) > 16384) {
+				break;
+			}
+
+			b = safe_realloc( b, len + act_header->tag_len + 1 + strlen( content ) + 1 );
+
+			memcpy( b + len, HEADER_TAG(act_header), act_header->tag_len );
+			len += act_header->tag_len;
+			b[len++] = ':';
+			strcpy( b + len, content );
+			len += strlen( content );
+		}
+	}
+	return( b );
+}
+
+
+
+/**********************************************************
+** forget the headers, the block and array are kept for the next ***/
+
+void free_headers(void)
+{
+	header_count = 0;
+}
+
+
+/**********************************************************
+** print header chain for deguging ***/
+
+void print_header_chain(void)
+{
+	headers *act_header;
+
+	for ( act_header = header; act_header < header + header_count; act_header++ )
+		printf( "%.*s: %s\n", (int)act_header->tag_len, HEADER_TAG(act_header), header_content( act_header ) );
+}
+
+
+
+/**********************************************************
+** config_path - path of an optional data file in the config dir */
+
+char *config_path( char *buf, size_t size, const char *name )
+{
+	char *dir = getenv("AUTORESPOND_CONFIG");
+
+	if ( dir == (char *)NULL || *dir == '\0' )
+		dir = CONFIG_DIR;
+	snprintf(buf, size, "%s/%s", dir, name);
+	return buf;
+}
+
+
+
+/**********************************************************
+** next_address - step through the addresses of an address header
+** *cursor is advanced past the address, its local part and domain
+** are returned as slices into the header. returns 0 when done */
+
+int next_address( const char **cursor, const char **local, size_t *local_len,
+	const char **domain, size_t *domain_len )
+{
+	const char *p = *cursor;
+	const char *start, *end, *angle, *at, *q;
+	int quoted;
+
+	while ( *p != '\0' )
+	{
+		/* find the end of this address, ignoring commas in quoted names */
+		start = p;
+		angle = (const char *)NULL;
+		quoted = 0;
+		for ( ; *p != '\0'; p++ )
+		{
+			if ( *p == '"' )
+				quoted = !quoted;
+			else if ( *p == '\\' && quoted && p[1] != '\0' )
+				p++;
+			else if ( !quoted && *p == '<' )
+				angle = p + 1;
+			else if ( !quoted && *p == ',' )
+				break;
+		}
+		end = p;
+		if ( *p == ',' )
+			p++;
+
+		if ( angle != (const char *)NULL )
+		{
+			start = angle;
+			if ( (q = memchr( angle, '>', end - angle )) != NULL )
+				end = q;
+		}
+
+		at = (const char *)NULL;
+		for ( q = start; q < end; q++ )
+			if ( *q == '@' )
+				at = q;
+		if ( at == (const char *)NULL )
+			continue;
+
+		/* a bare address may be preceded by a name or followed by a comment */
+		for ( q = at; q > start && !isspace((unsigned char)q[-1]) && q[-1] != '"'; q-- )
+			;
+		*local = q;
+		*local_len = at - q;
+		for ( q = at + 1; q < end && !isspace((unsigned char)*q) && *q != '(' && *q != '>'; q++ )
+			;
+		while ( q > at + 1 && q[-1] == '.' )
+			q--;
+		*domain = at + 1;
+		*domain_len = q - (at + 1);
+
+		*cursor = p;
+		return 1;
+	}
+	*cursor = p;
+	return 0;
+}
+
+
+
+/**********************************************************
+** domain trie - the filter domains stored reversed, one character
+** per node, so a lookup costs O(domain length) whatever the list size.
+** node 0 is the root, children are kept as first-child/next-sibling */
+
+typedef struct _trie_node {
+	unsigned char c;
+	unsigned char terminal;		/* a listed domain ends here */
+	unsigned int child;
+	unsigned int sibling;
+} trie_node;
+
+static trie_node *domain_trie = (trie_node *)NULL;
+static unsigned int domain_trie_len = 0;
+static unsigned int domain_trie_size = 0;
+
+void domain_trie_add( const char *domain, size_t len )
+{
+	unsigned int node = 0, n;
+	unsigned char c;
+
+	/* tolerate "@domain" and ".domain" spellings in the data file */
+	while ( len > 0 && (*domain == '@' || *domain == '.') ) {
+		domain++;
+		len--;
+	}
+	if ( len == 0 )
+		return;
+
+	while ( len-- > 0 )
+	{
+		c = tolower( (unsigned char)domain[len] );
+		for ( n = domain_trie[node].child; n != 0; n = domain_trie[n].sibling )
+			if ( domain_trie[n].c == c )
+				break;
+		if ( n == 0 )
+		{
+			if ( domain_trie_len == domain_trie_size )
+			{
+				domain_trie_size *= 2;
+				domain_trie = (trie_node *)safe_realloc( domain_trie, domain_trie_size * sizeof(trie_node) );
+			}
+			n = domain_trie_len++;
+			domain_trie[n].c = c;
+			domain_trie[n].terminal = 0;
+			domain_trie[n].child = 0;
+			domain_trie[n].sibling = domain_trie[node].child;
+			domain_trie[node].child = n;
+		}
+		node = n;
+	}
+	domain_trie[node].terminal = 1;
+}
+
+void domain_trie_init(void)
+{
+	char path[PATH_MAX];
+	char *data, *line, *end;
+	int i;
+
+	domain_trie_size = 4096;
+	domain_trie = (trie_node *)safe_malloc( domain_trie_size * sizeof(trie_node) );
+	memset( &domain_trie[0], 0, sizeof(trie_node) );
+	domain_trie_len = 1;
+
+	for ( i = 0; sender_filter_domains[i] != NULL; i++ )
+		domain_trie_add( sender_filter_domains[i], strlen(sender_filter_domains[i]) );
+
+	/* one domain per line, # starts a comment */
+	data = read_file( config_path( path, sizeof(path), "filter_domains" ) );
+	if ( data == (char *)NULL )
+		return;
+	for ( line = data; *line != '\0'; line = end )
+	{
+		end = line + strcspn( line, "\n" );
+		while ( line < end && isspace((unsigned char)*line) )
+			line++;
+		if ( line < end && *line != '#' )
+			domain_trie_add( line, strcspn( line, " \t\r\n#" ) );
+		if ( *end == '\n' )
+			end++;
+	}
+	free( data );
+}
+
+/* returns 1 if the domain or one of its parent domains is listed */
+int domain_trie_match( const char *domain, size_t len )
+{
+	unsigned int node = 0, n;
+	unsigned char c;
+
+	if ( domain_trie == (trie_node *)NULL )
+		domain_trie_init();
+
+	while ( len-- > 0 )
+	{
+		c = tolower( (unsigned char)domain[len] );
+		for ( n = domain_trie[node].child; n != 0; n = domain_trie[n].sibling )
+			if ( domain_trie[n].c == c )
+				break;
+		if ( n == 0 )
+			return 0;
+		node = n;
+		if ( domain_trie[node].terminal && (len == 0 || domain[len-1] == '.') )
+			return 1;
+	}
+	return 0;
+}
+
+
+
+/**********************************************************
+** keyword matcher - an Aho-Corasick automaton over the filter keywords,
+** so the local part of an address is scanned once whatever the number
+** of keywords. Keywords are split into segments at each ".?"; only the
+** last segment is in the automaton, and when it matches the earlier
+** segments are checked right before it, each at most one character apart */
+
+#define AC_MAX_SEGMENTS 8
+
+typedef struct _ac_keyword {
+	char *text;				/* lower case, separators removed */
+	unsigned int nseg;
+	unsigned int seg_end[AC_MAX_SEGMENTS];	/* end of each segment in text */
+} ac_keyword;
+
+typedef struct _ac_output {
+	unsigned int keyword;
+	int next;
+} ac_output;
+
+static ac_keyword *ac_keywords = (ac_keyword *)NULL;
+static unsigned int ac_nkeywords = 0, ac_keywords_size = 0;
+static ac_output *ac_outputs = (ac_output *)NULL;
+static unsigned int ac_noutputs = 0;
+static unsigned char ac_class[256];	/* byte -> input class, 0 = not in any keyword */
+static unsigned int ac_nclasses = 1;
+static unsigned int *ac_delta = (unsigned int *)NULL;	/* ac_nstates x ac_nclasses */
+static unsigned int *ac_fail;
+static int *ac_out;			/* first output of each state, -1 = none */
+static unsigned int ac_nstates = 0, ac_states_size = 0;
+
+void ac_keyword_add( const char *kw, size_t len )
+{
+	ac_keyword *k;
+	size_t i;
+	unsigned int n = 0;
+
+	if ( ac_nkeywords == ac_keywords_size )
+	{
+		ac_keywords_size = ac_keywords_size ? ac_keywords_size * 2 : 128;
+		ac_keywords = (ac_keyword *)safe_realloc( ac_keywords, ac_keywords_size * sizeof(ac_keyword) );
+	}
+	k = &ac_keywords[ac_nkeywords];
+	k->text = (char *)safe_malloc( len + 1 );
+	k->nseg = 0;
+	for ( i = 0; i < len; i++ )
+	{
+		if ( kw[i] == '.' && i + 1 < len && kw[i+1] == '?' )
+		{
+			/* close the current segment, leading and doubled separators are ignored */
+			if ( n > (k->nseg ? k->seg_end[k->nseg-1] : 0) && k->nseg < AC_MAX_SEGMENTS - 1 )
+				k->seg_end[k->nseg++] = n;
+			i++;
+			continue;
+		}
+		k->text[n++] = tolower( (unsigned char)kw[i] );
+	}
+	k->text[n] = '\0';
+	if ( n == 0 )
+	{
+		free( k->text );
+		return;
+	}
+	if ( n > (k->nseg ? k->seg_end[k->nseg-1] : 0) )
+		k->seg_end[k->nseg++] = n;
+	ac_nkeywords++;
+}
+
+unsigned int ac_new_state(void)
+{
+	if ( ac_nstates == ac_states_size )
+	{
+		ac_states_size *= 2;
+		ac_delta = (unsigned int *)safe_realloc( ac_delta, ac_states_size * ac_nclasses * sizeof(unsigned int) );
+		ac_out = (int *)safe_realloc( ac_out, ac_states_size * sizeof(int) );
+	}
+	memset( &ac_delta[ac_nstates * ac_nclasses], 0, ac_nclasses * sizeof(unsigned int) );
+	ac_out[ac_nstates] = -1;
+	return ac_nstates++;
+}
+
+void ac_init(void)
+{
+	char path[PATH_MAX];
+	char *data, *line, *end;
+	unsigned int i, j, state, start, a, r, s, *queue, qhead, qtail;
+	unsigned char *visited;
+	int o;
+
+	for ( i = 0; sender_filter_keywords[i] != NULL; i++ )
+		ac_keyword_add( sender_filter_keywords[i], strlen(sender_filter_keywords[i]) );
+
+	/* one keyword per line, # starts a comment */
+	data = read_file( config_path( path, sizeof(path), "filter_keywords" ) );
+	if ( data != (char *)NULL )
+	{
+		for ( line = data; *line != '\0'; line = end )
+		{
+			end = line + strcspn( line, "\n" );
+			while ( line < end && isspace((unsigned char)*line) )
+				line++;
+			if ( line < end && *line != '#' )
+				ac_keyword_add( line, strcspn( line, " \t\r\n#" ) );
+			if ( *end == '\n' )
+				end++;
+		}
+		free( data );
+	}
+
+	/* map each byte that appears in a keyword to its own input class */
+	memset( ac_class, 0, sizeof(ac_class) );
+	for ( i = 0; i < ac_nkeywords; i++ )
+		for ( j = 0; ac_keywords[i].text[j] != '\0'; j++ )
+		{
+			a = (unsigned char)ac_keywords[i].text[j];
+			if ( ac_class[a] == 0 )
+			{
+				ac_class[a] = ac_nclasses;
+				ac_class[toupper(a)] = ac_nclasses;
+				ac_nclasses++;
+			}
+		}
+
+	/* the goto function: a trie of the last segments */
+	ac_states_size = 256;
+	ac_delta = (unsigned int *)safe_malloc( ac_states_size * ac_nclasses * sizeof(unsigned int) );
+	ac_out = (int *)safe_malloc( ac_states_size * sizeof(int) );
+	ac_outputs = (ac_output *)safe_malloc( (ac_nkeywords + 1) * sizeof(ac_output) );
+	ac_new_state();
+	for ( i = 0; i < ac_nkeywords; i++ )
+	{
+		start = ac_keywords[i].nseg > 1 ? ac_keywords[i].seg_end[ac_keywords[i].nseg-2] : 0;
+		state = 0;
+		for ( j = start; ac_keywords[i].text[j] != '\0'; j++ )
+		{
+			a = ac_class[(unsigned char)ac_keywords[i].text[j]];
+			if ( ac_delta[state * ac_nclasses + a] == 0 )
+			{
+				s = ac_new_state();
+				ac_delta[state * ac_nclasses + a] = s;
+			}
+			state = ac_delta[state * ac_nclasses + a];
+		}
+		ac_outputs[ac_noutputs].keyword = i;
+		ac_outputs[ac_noutputs].next = ac_out[state];
+		ac_out[state] = ac_noutputs++;
+	}
+
+	/* failure links by breadth first search, turning the trie into a DFA.
+	   trie children are the only transitions to states not yet visited */
+	ac_fail = (unsigned int *)safe_malloc( ac_nstates * sizeof(unsigned int) );
+	queue = (unsigned int *)safe_malloc( ac_nstates * sizeof(unsigned int) );
+	visited = (unsigned char *)safe_malloc( ac_nstates );
+	memset( visited, 0, ac_nstates );
+	qhead = qtail = 0;
+	ac_fail[0] = 0;
+	visited[0] = 1;
+	for ( a = 0; a < ac_nclasses; a++ )
+	{
+		if ( (s = ac_delta[a]) != 0 )
+		{
+			ac_fail[s] = 0;
+			visited[s] = 1;
+			queue[qtail++] = s;
+		}
+	}
+	while ( qhead < qtail )
+	{
+		r = queue[qhead++];
+		for ( a = 0; a < ac_nclasses; a++ )
+		{
+			s = ac_delta[r * ac_nclasses + a];
+			if ( s != 0 && !visited[s] )
+			{
+				ac_fail[s] = ac_delta[ac_fail[r] * ac_nclasses + a];
+				visited[s] = 1;
+				/* append the outputs of the failure state */
+				if ( ac_out[s] == -1 )
+					ac_out[s] = ac_out[ac_fail[s]];
+				else
+				{
+					for ( o = ac_out[s]; ac_outputs[o].next != -1; o = ac_outputs[o].next )
+						;
+					ac_outputs[o].next = ac_out[ac_fail[s]];
+				}
+				queue[qtail++] = s;
+			} else
+				ac_delta[r * ac_nclasses + a] = ac_delta[ac_fail[r] * ac_nclasses + a];
+		}
+	}
+	free( queue );
+	free( visited );
+}
+
+/* check segment seg of a keyword ends at end, and the earlier ones before it */
+int ac_verify( const ac_keyword *k, unsigned int seg, const char *begin, const char *end )
+{
+	unsigned int seg_start = seg > 0 ? k->seg_end[seg-1] : 0;
+	size_t len = k->seg_end[seg] - seg_start;
+	size_t i;
+	int gap;
+
+	if ( (size_t)(end - begin) < len )
+		return 0;
+	for ( i = 0; i < len; i++ )
+		if ( tolower( (unsigned char)end[i - len] ) != k->text[seg_start + i] )
+			return 0;
+	if ( seg == 0 )
+		return 1;
+	for ( gap = 0; gap <= 1 && end - len - gap >= begin; gap++ )
+		if ( ac_verify( k, seg - 1, begin, end - len - gap ) )
+			return 1;
+	return 0;
+}
+
+/* returns 1 if any keyword occurs in the text */
+int ac_match( const char *text, size_t len )
+{
+	unsigned int state = 0;
+	size_t i;
+	int o;
+	ac_keyword *k;
+
+	if ( ac_delta == (unsigned int *)NULL )
+		ac_init();
+
+	for ( i = 0; i < len; i++ )
+	{
+		state = ac_delta[state * ac_nclasses + ac_class[(unsigned char)text[i]]];
+		for ( o = ac_out[state]; o != -1; o = ac_outputs[o].next )
+		{
+			k = &ac_keywords[ac_outputs[o].keyword];
+			if ( k->nseg == 1 || ac_verify( k, k->nseg - 1, text, text + i + 1 ) )
+				return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+/**********************************************************
+** sender_filter_matches - Check if header matches sender filter list
+** every address in the header is checked: its local part against the
+** role-account keywords and its domain against the domain trie */
+
+int sender_filter_matches( const char *header_str )
+{
+	const char *cursor, *local, *domain;
+	size_t local_len, domain_len;
+
+	cursor = header_str;
+	while ( next_address( &cursor, &local, &local_len, &domain, &domain_len ) )
+	{
+		if ( ac_match( local, local_len ) || domain_trie_match( domain, domain_len ) )
+			return 1;
+	}
+	return 0;
+}
+
+
+
+/**********************************************************
+** clock_ns - monotonic time in nanoseconds, for timing */
+
+unsigned long long clock_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/**********************************************************
+** filter rules
+** CONFIG_DIR/rules (or default_rules) is compiled once into a table;
+** a rule naming several headers becomes one entry per header, in the
+** order given. entries of the same header name are chained and hashed
+** by name, so a message is classified in one pass over its headers:
+** the entry that comes first in the table wins */
+
+#define RULE_PRESENT	0	/*the header is there*/
+#define RULE_CONTAINS	1	/*its content contains pattern, ignoring case*/
+#define RULE_REGEX	2	/*its content matches the extended regex pattern*/
+#define RULE_ADDRLIST	3	/*one of its addresses is on the sender filter list*/
+
+static char *rule_kinds[] = { "present", "contains", "regex", "addrlist", NULL };
+
+typedef struct _rule {
+	int kind;
+	char *tag;
+	size_t tag_len;
+	unsigned int hash;
+	char *pattern;
+	size_t pattern_len;
+	regex_t re;
+	int code;		/*exit code*/
+	char *message;		/*%h is the header, %s its content*/
+	int next;		/*next entry for this header, -1 for none*/
+} rule;
+
+static rule *rules = (rule *)NULL;
+static int rule_count = 0;
+static int rule_size = 0;
+static int *rule_table = (int *)NULL;
+static unsigned int rule_table_size = 0;
+static int rules_allowed = 0;	/*the sender is allowed: rules that exit 0 don't count*/
+static unsigned long long *rule_ns = (unsigned long long *)NULL;	/*--replay: time in each rule*/
+static unsigned long *rule_tests = (unsigned long *)NULL;
+
+void rule_error( const char *source, int lineno, const char *why )
+{
+	fprintf(stderr, "AUTORESPOND: %s line %d: %s.\n", source, lineno, why);
+	_exit(111);
+}
+
+/* the next whitespace separated word of *cursor, terminated in place */
+char *rule_word( char **cursor )
+{
+	char *w = *cursor + strspn( *cursor, " \t" );
+
+	*cursor = w + strcspn( w, " \t" );
+	if ( **cursor != '\0' )
+		*(*cursor)++ = '\0';
+	return *w == '\0' ? (char *)NULL : w;
+}
+
+/* compile one line, which stays in use by the rules */
+void rule_compile( char *line, const char *source, int lineno )
+{
+	char *kind, *tags, *pattern = (char *)NULL, *code, *message, *end, *tag;
+	int k, n;
+	rule *r;
+
+	line[strcspn( line, "\r" )] = '\0';
+	if ( (kind = rule_word( &line )) == (char *)NULL || *kind == '#' )
+		return;
+	for ( k = 0; rule_kinds[k] != NULL && strcasecmp( rule_kinds[k], kind ) != 0; k++ )
+		;
+	if ( rule_kinds[k] == NULL )
+		rule_error( source, lineno, "unknown kind of rule" );
+	if ( (tags = rule_word( &line )) == (char *)NULL )
+		rule_error( source, lineno, "no header" );
+	if ( (k == RULE_CONTAINS || k == RULE_REGEX) && (pattern = rule_word( &line )) == (char *)NULL )
+		rule_error( source, lineno, "no pattern" );
+	if ( (code = rule_word( &line )) == (char *)NULL )
+		rule_error( source, lineno, "no exit code" );
+	n = (int)strtol( code, &end, 10 );
+	if ( *end != '\0' || (n != 0 && n != 99 && n != 100 && n != 111) )
+		rule_error( source, lineno, "exit code is not 0, 99, 100 or 111" );
+	message = line + strspn( line, " \t" );
+	if ( *message == '\0' )
+		message = "%h header matches a rule, ignoring.";
+
+	for ( tag = tags; *tag != '\0'; tag = end )
+	{
+		end = tag + strcspn( tag, "," );
+		if ( !validate_header_tag( tag, end - tag ) )
+			rule_error( source, lineno, "bad header name" );
+		if ( rule_count == rule_size )
+		{
+			rule_size = rule_size ? rule_size * 2 : 32;
+			rules = (rule *)safe_realloc( rules, rule_size * sizeof(rule) );
+		}
+		r = &rules[rule_count++];
+		r->kind = k;
+		r->tag = tag;
+		r->tag_len = end - tag;
+		r->hash = header_hash( tag, end - tag );
+		r->pattern = pattern;
+		r->pattern_len = pattern ? strlen( pattern ) : 0;
+		r->code = n;
+		r->message = message;
+		if ( k == RULE_REGEX && regcomp( &r->re, pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB ) != 0 )
+			rule_error( source, lineno, "bad regular expression" );
+		if ( *end == ',' )
+			*end++ = '\0';
+	}
+}
+
+void rules_init( void )
+{
+	char path[PATH_MAX];
+	char *data, *line, *end;
+	unsigned int size, slot;
+	int i, lineno = 0, *last;
+
+	if ( rule_table != (int *)NULL )
+		return;
+	data = read_file( config_path( path, sizeof(path), "rules" ) );
+	if ( data != (char *)NULL )
+	{
+		line = (char *)safe_malloc( sizeof(LOOP_RULE) );
+		strcpy( line, LOOP_RULE );
+		rule_compile( line, "built in rules", 1 );
+		/* one rule per line, # starts a comment line */
+		for ( line = data; *line != '\0'; line = end )
+		{
+			end = line + strcspn( line, "\n" );
+			if ( *end == '\n' )
+				*end++ = '\0';
+			rule_compile( line, path, ++lineno );
+		}
+	} else
+	{
+		for ( i = 0; default_rules[i] != NULL; i++ )
+		{
+			line = (char *)safe_malloc( strlen( default_rules[i] ) + 1 );
+			strcpy( line, default_rules[i] );
+			rule_compile( line, "default rules", i + 1 );
+		}
+	}
+
+	for ( size = 64; size < (unsigned int)rule_count * 2; size *= 2 )
+		;
+	rule_table_size = size;
+	rule_table = (int *)safe_malloc( size * sizeof(int) );
+	memset( rule_table, 0xff, size * sizeof(int) );
+	/* backwards, so each chain comes out in table order */
+	for ( i = rule_count - 1; i >= 0; i-- )
+	{
+		rules[i].next = -1;
+		for ( slot = rules[i].hash & (size - 1); ; slot = (slot + 1) & (size - 1) )
+		{
+			last = &rule_table[slot];
+			if ( *last == -1 )
+				break;
+			if ( rules[*last].hash == rules[i].hash && rules[*last].tag_len == rules[i].tag_len
+				&& strncasecmp( rules[*last].tag, rules[i].tag, rules[i].tag_len ) == 0 )
+			{
+				rules[i].next = *last;
+				break;
+			}
+		}
+		*last = i;
+	}
+}
+
+/* the first entry for the header's name, -1 for none */
+int rule_first( headers *h )
+{
+	unsigned int slot;
+	rule *r;
+
+	for ( slot = h->hash & (rule_table_size - 1); rule_table[slot] != -1; slot = (slot + 1) & (rule_table_size - 1) )
+	{
+		r = &rules[rule_table[slot]];
+		if ( r->hash == h->hash && r->tag_len == h->tag_len && strncasecmp( r->tag, HEADER_TAG(h), h->tag_len ) == 0 )
+			return rule_table[slot];
+	}
+	return -1;
+}
+
+int rule_test( rule *r, headers *h )
+{
+	char *content;
+
+	if ( r->kind == RULE_PRESENT )
+		return 1;
+	content = header_content( h );
+	switch ( r->kind )
+	{
+	case RULE_CONTAINS:
+		return casesearch( content, strlen( content ), r->pattern, r->pattern_len ) != (char *)NULL;
+	case RULE_REGEX:
+		return regexec( &r->re, content, 0, NULL, 0 ) == 0;
+	case RULE_ADDRLIST:
+		return sender_filter_matches( content );
+	}
+	return 0;
+}
+
+/**********************************************************
+** rules_match - classify the message in one pass over its headers
+** returns the deciding rule and the header it matched, or NULL */
+
+rule *rules_match( headers **matched )
+{
+	headers *h;
+	int i, best, hit;
+	unsigned long long t;
+
+	rules_init();
+	best = rule_count;
+	for ( h = header; h < header + header_count; h++ )
+	{
+		for ( i = rule_first( h ); i != -1 && i < best; i = rules[i].next )
+		{
+			if ( rules_allowed && rules[i].code == 0 )
+				continue;
+			if ( rule_ns != (unsigned long long *)NULL )
+			{
+				t = clock_ns();
+				hit = rule_test( &rules[i], h );
+				rule_ns[i] += clock_ns() - t;
+				rule_tests[i]++;
+			} else
+				hit = rule_test( &rules[i], h );
+			if ( hit )
+			{
+				best = i;
+				*matched = h;
+				break;
+			}
+		}
+	}
+	return best < rule_count ? &rules[best] : (rule *)NULL;
+}
+
+/**********************************************************
+** rules_check_header - for read_headers(): test a header as soon as
+** it is read, the first header a rule matches decides */
+
+static rule *stream_rule = (rule *)NULL;
+static headers *stream_header = (headers *)NULL;
+
+int rules_check_header( headers *h )
+{
+	int i;
+
+	for ( i = rule_first( h ); i != -1; i = rules[i].next )
+	{
+		if ( rules_allowed && rules[i].code == 0 )
+			continue;
+		if ( rule_test( &rules[i], h ) )
+		{
+			stream_rule = &rules[i];
+			stream_header = h;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* log the decision: the message with %h and %s filled in */
+void rule_log( rule *r, headers *h )
+{
+	char *p;
+
+	fputs( "AUTORESPOND: ", stderr );
+	for ( p = r->message; *p != '\0'; p++ )
+	{
+		if ( *p == '%' && p[1] == 'h' )
+			fprintf( stderr, "%.*s", (int)r->tag_len, r->tag ), p++;
+		else if ( *p == '%' && p[1] == 's' )
+			fputs( header_content( h ), stderr ), p++;
+		else if ( *p == '%' && p[1] == '%' )
+			fputc( '%', stderr ), p++;
+		else
+			fputc( *p, stderr );
+	}
+	fputc( '\n', stderr );
+}
+
+
+
+/**********************************************************
+** sender lists
+** CONFIG_DIR/senders.cdb, made by autorespond-mkcdb -s, names the
+** addresses and domains that always (allow) or never (deny) get a
+** reply. an address is looked up as it is, then by its domain and
+** each parent domain; at each step an entry for the recipient comes
+** before one for everybody. SENDER, From and Reply-To are looked up,
+** a deny for any of them wins over an allow */
+
+#define LIST_NONE	0
+#define LIST_ALLOW	1
+#define LIST_DENY	2
+
+static cdb sender_cdb;
+static int sender_cdb_open = 0;
+
+int sender_list_find( const char *recipient, const char *local, size_t local_len,
+	const char *domain, size_t domain_len )
+{
+	char addr[512], key[1024];
+	const char *c, *next;
+	char *v;
+	size_t n, i, len, dlen;
+
+	if ( local_len + 1 + domain_len >= sizeof(addr) )
+		return LIST_NONE;
+	for ( i = 0; i < local_len; i++ )
+		addr[i] = tolower( (unsigned char)local[i] );
+	addr[i++] = '@';
+	for ( n = 0; n < domain_len; n++ )
+		addr[i++] = tolower( (unsigned char)domain[n] );
+	len = i;
+
+	/* the address, then the domains from the longest */
+	for ( c = addr; c != (char *)NULL; c = next )
+	{
+		n = addr + len - c;
+		i = snprintf( key, sizeof(key), "%s %.*s", recipient, (int)n, c );
+		v = (char *)NULL;
+		if ( i < sizeof(key) )
+		{
+			/* the recipient as autorespond-mkcdb stores it */
+			for ( dlen = 0; dlen < i; dlen++ )
+				key[dlen] = tolower( (unsigned char)key[dlen] );
+			v = cdb_find( &sender_cdb, key, i, &dlen );
+		}
+		if ( v == (char *)NULL )
+			v = cdb_find( &sender_cdb, c, n, &dlen );
+		if ( v != (char *)NULL )
+			return dlen > 0 && *v == '-' ? LIST_DENY : LIST_ALLOW;
+		if ( (next = memchr( c, c == addr ? '@' : '.', n )) != (char *)NULL )
+			next++;
+	}
+	return LIST_NONE;
+}
+
+/* what the lists say of the message; the envelope only without
+   headers. a deny is logged */
+int sender_list_check( const char *sender, const char *recipient, int with_headers )
+{
+	static char *tags[] = { "From", "Reply-To", NULL };
+	char path[PATH_MAX];
+	const char *cursor, *local, *domain;
+	size_t local_len, domain_len;
+	headers *h;
+	int i, r, result = LIST_NONE;
+
+	if ( !sender_cdb_open )
+	{
+		cdb_open( &sender_cdb, config_path( path, sizeof(path), "senders.cdb" ) );
+		sender_cdb_open = 1;
+	}
+	if ( sender_cdb.map == (char *)NULL )
+		return LIST_NONE;
+
+	if ( (domain = strrchr( sender, '@' )) != (char *)NULL )
+	{
+		r = sender_list_find( recipient, sender, domain - sender, domain + 1, strlen( domain + 1 ) );
+		if ( r == LIST_DENY )
+		{
+			fprintf(stderr, "AUTORESPOND: Sender [%.*s] is on the deny list, ignoring.\n", 100, sender);
+			return r;
+		}
+		result = r;
+	}
+	for ( i = 0; with_headers && tags[i] != NULL; i++ )
+	{
+		for ( h = header_find( tags[i] ); h != (headers *)NULL; h = header_next( h ) )
+		{
+			cursor = header_content( h );
+			while ( next_address( &cursor, &local, &local_len, &domain, &domain_len ) )
+			{
+				r = sender_list_find( recipient, local, local_len, domain, domain_len );
+				if ( r == LIST_DENY )
+				{
+					fprintf(stderr, "AUTORESPOND: %s address [%.*s@%.*s] is on the deny list, ignoring.\n",
+						tags[i], (int)local_len, local, (int)domain_len, domain);
+					return r;
+				}
+				if ( r == LIST_ALLOW )
+					result = r;
+			}
+		}
+	}
+	return result;
+}
+
+
+
+/**********************************************************
+** sender_hash - FNV-1a over the lower cased address, never 0 */
+
+uint64_t sender_hash( const char *sender )
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for ( ; *sender != '\0'; sender++ )
+	{
+		h ^= (unsigned char)tolower( (unsigned char)*sender );
+		h *= 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+
+
+/**********************************************************
+** rate log files - the one file per message log. each sender has a
+** directory S<hash> named after the 64 bit hash of its lower cased
+** address, holding a file <time>.<pid>.<rand> per message, so the
+** count only lists the sender's own directory and never opens a file.
+** the time is zero padded so the names sort in time order */
+
+#define FILES_MARKER	"autorespond.files"	/* present once A-files are converted */
+
+#define FILES_SDIR	32	/*room for the name of a sender directory*/
+
+void files_sender_dir( char *buf, size_t size, uint64_t h )
+{
+	snprintf( buf, size, "S%016llx", (unsigned long long)h );
+}
+
+/* create the log entry of a message at time t in the sender directory,
+   whose name is left in sdir (FILES_SDIR bytes) */
+int files_add( uint64_t h, const char *sender, unsigned int t, char *filename, size_t size, char *sdir )
+{
+	int fd = -1;
+	int attempts;
+
+	files_sender_dir( sdir, FILES_SDIR, h );
+	for ( attempts = 0; fd == -1 && attempts < 100; attempts++ )
+	{
+		snprintf( filename, size, "%s/%010u.%u.%u", sdir, t, (unsigned int)getpid(), (unsigned int)random() );
+		fd = open( filename, O_CREAT | O_EXCL | O_WRONLY, 0600 );
+		if ( fd == -1 && errno == ENOENT )
+		{
+			if ( mkdir( sdir, 0700 ) == -1 && errno != EEXIST )
+				return -1;
+		} else if ( fd == -1 && errno != EEXIST )
+			return -1;
+	}
+	if ( fd == -1 )
+		return -1;
+	/* the address is kept for reference only, counting never reads it */
+	if ( write( fd, sender, strlen(sender) ) != (ssize_t)strlen(sender) )
+	{
+		close( fd );
+		unlink( filename );
+		return -1;
+	}
+	close( fd );
+	return 0;
+}
+
+/* convert the A<pid>.<time>.<rand> files of older versions, once */
+void files_migrate( unsigned int timer, unsigned int time_message )
+{
+	DIR * dirp;
+	struct dirent * direntp;
+	unsigned int message_time;
+	char * address;
+	char * ptr;
+	char filename[64];
+	char sdir[FILES_SDIR];
+	int fd;
+
+	if ( access( FILES_MARKER, F_OK ) == 0 )
+		return;
+	if ( (fd = open( FILES_MARKER ".lock", O_RDWR | O_CREAT, 0600 )) == -1 )
+		return;
+	flock( fd, LOCK_EX );
+	if ( access( FILES_MARKER, F_OK ) != 0 && (dirp = opendir(".")) != NULL )
+	{
+		while ( (direntp = readdir(dirp)) != NULL )
+		{
+			if ( direntp->d_name[0] != 'A' || (ptr = strchr(direntp->d_name,'.')) == NULL )
+				continue;
+			message_time = strtoul(ptr+1,NULL,10);
+			if ( message_time + time_message >= timer && (address = read_file(direntp->d_name)) != NULL )
+			{
+				/*queued for expiry like any entry, or --gc would never see it*/
+				if ( files_add( sender_hash(address), address, message_time, filename, sizeof(filename), sdir ) == 0 )
+					files_queue_expiry( sdir, message_time );
+				free(address);
+			}
+			unlink(direntp->d_name);
+		}
+		closedir(dirp);
+		close( open( FILES_MARKER, O_WRONLY | O_CREAT, 0600 ) );
+	}
+	close( fd );
+	unlink( FILES_MARKER ".lock" );
+}
+
+/**********************************************************
+** expiry queue - the sender directories that got an entry are also
+** listed in expire/<bucket>/, one bucket per GC_BUCKET seconds, so
+** expired entries can be collected oldest bucket first, stopping at
+** the first bucket that is still inside the window. each delivery
+** sweeps at most GC_BUDGET senders, "autorespond --gc" sweeps them all */
+
+#define GC_DIR		"expire"
+#define GC_BUCKET	3600
+#define GC_BUDGET	16
+
+/* open and lock a sender directory, creating it if asked. the lock
+   holder may remove the directory once it is empty, so make sure the
+   one locked is still in place */
+int files_lock_sender( const char *sdir, int create )
+{
+	struct stat st, cur;
+	int fd;
+
+	for ( ;; )
+	{
+		if ( create && mkdir( sdir, 0700 ) == -1 && errno != EEXIST )
+			return -1;
+		if ( (fd = open( sdir, O_RDONLY | O_DIRECTORY )) == -1 )
+		{
+			if ( errno == ENOENT && create )
+				continue;
+			return -1;
+		}
+		if ( flock( fd, LOCK_EX ) == -1 || fstat( fd, &st ) == -1 )
+		{
+			close( fd );
+			return -1;
+		}
+		if ( stat( sdir, &cur ) == 0 && cur.st_ino == st.st_ino && cur.st_dev == st.st_dev )
+			return fd;
+		close( fd );
+		if ( !create )
+			return -1;
+	}
+}
+
+void files_queue_expiry( const char *sdir, unsigned int timer )
+{
+	char path[64];
+	int fd;
+
+	snprintf( path, sizeof(path), GC_DIR "/%u", timer / GC_BUCKET );
+	if ( (mkdir( GC_DIR, 0700 ) == -1 && errno != EEXIST) || (mkdir( path, 0700 ) == -1 && errno != EEXIST) )
+		return;
+	snprintf( path, sizeof(path), GC_DIR "/%u/%s", timer / GC_BUCKET, sdir );
+	if ( (fd = open( path, O_WRONLY | O_CREAT, 0600 )) != -1 )
+		close( fd );
+}
+
+/* remove the expired entries of a sender, and its directory once empty */
+void files_clean_sender( const char *sdir, unsigned int timer, unsigned int time_message )
+{
+	DIR * dirp;
+	struct dirent * direntp;
+	unsigned int live = 0;
+	int fd;
+
+	if ( (fd = files_lock_sender( sdir, 0 )) == -1 )
+		return;
+	if ( (dirp = fdopendir( fd )) == NULL )
+	{
+		close( fd );
+		return;
+	}
+	while ( (direntp = readdir(dirp)) != NULL )
+	{
+		if ( !isdigit((unsigned char)direntp->d_name[0]) )
+			continue;
+		if ( strtoul(direntp->d_name,NULL,10) + time_message < timer )
+			unlinkat( fd, direntp->d_name, 0 );
+		else
+			live++;
+	}
+	if ( live == 0 )
+		rmdir( sdir );
+	closedir( dirp );
+}
+
+/* sweep the expiry queue, budget 0 means no limit. returns the number
+   of senders visited */
+unsigned int files_gc( unsigned int timer, unsigned int time_message, unsigned int budget )
+{
+	DIR * qdirp;
+	DIR * bdirp;
+	struct dirent * direntp;
+	unsigned long bucket, oldest;
+	unsigned int done = 0;
+	char path[sizeof(GC_DIR) + 24 + sizeof(((struct dirent *)0)->d_name)];
+	int fd;
+
+	/* one sweeper at a time, deliveries just skip their turn */
+	if ( (fd = open( GC_DIR, O_RDONLY | O_DIRECTORY )) == -1 )
+		return 0;
+	if ( flock( fd, budget ? LOCK_EX | LOCK_NB : LOCK_EX ) == -1 || (qdirp = fdopendir( fd )) == NULL )
+	{
+		close( fd );
+		return 0;
+	}
+	for ( ;; )
+	{
+		rewinddir( qdirp );
+		oldest = ULONG_MAX;
+		while ( (direntp = readdir(qdirp)) != NULL )
+		{
+			if ( !isdigit((unsigned char)direntp->d_name[0]) )
+				continue;
+			bucket = strtoul(direntp->d_name,NULL,10);
+			if ( bucket < oldest )
+				oldest = bucket;
+		}
+		/* the newest entry of a bucket is at most GC_BUCKET seconds from its end */
+		if ( oldest == ULONG_MAX || (oldest + 1) * GC_BUCKET + time_message > timer )
+			break;
+
+		snprintf( path, sizeof(path), GC_DIR "/%lu", oldest );
+		if ( (bdirp = opendir( path )) == NULL )
+			break;
+		while ( (direntp = readdir(bdirp)) != NULL && (budget == 0 || done < budget) )
+		{
+			if ( direntp->d_name[0] != 'S' )
+				continue;
+			files_clean_sender( direntp->d_name, timer, time_message );
+			snprintf( path, sizeof(path), GC_DIR "/%lu/%s", oldest, direntp->d_name );
+			unlink( path );
+			done++;
+		}
+		closedir( bdirp );
+		snprintf( path, sizeof(path), GC_DIR "/%lu", oldest );
+		if ( rmdir( path ) == -1 )
+			break;		/* budget used up */
+	}
+	closedir( qdirp );
+	return done;
+}
+
+
+
+/* log entries (files or index slots) looked at by the rate limit */
+static unsigned long rate_scanned = 0;
+
+/**********************************************************
+** rate_limit_files - check and log a reply to the sender under a lock
+** on the sender's directory: returns 1 and adds an entry (its path in
+** entry) if fewer than num replies were logged within time_message
+** seconds, 0 otherwise, -1 if the log can't be used. expired entries
+** are removed on the way */
+
+int rate_limit_files( char *sender, unsigned int timer, unsigned int time_message, unsigned int num,
+	char *entry, size_t size )
+{
+	DIR * dirp;
+	struct dirent * direntp;
+	unsigned int message_time;
+	unsigned int count;
+	char sdir[FILES_SDIR];
+	uint64_t h;
+	int fd;
+
+	files_migrate( timer, time_message );
+
+	h = sender_hash( sender );
+	files_sender_dir( sdir, sizeof(sdir), h );
+	if ( (fd = files_lock_sender( sdir, 1 )) == -1 || (dirp = fdopendir( fd )) == NULL ) {
+		fprintf(stderr,"AUTORESPOND: Unable to lock log directory for [%.*s].\n", 100, sender);
+		if ( fd != -1 )
+			close( fd );
+		return -1;
+	}
+
+	/*count the responses in the sender's log*/
+	count = 0;
+	while((direntp = readdir(dirp)) != NULL) {
+		rate_scanned++;
+		if ( !isdigit((unsigned char)direntp->d_name[0]) )
+			continue;
+		message_time = strtoul(direntp->d_name,NULL,10);
+		if(message_time + time_message < timer) {
+			/*too old..ignore errors on unlink*/
+			unlinkat(fd, direntp->d_name, 0);
+		} else
+			count++;
+	}
+
+	if ( count < num )
+	{
+		if ( files_add( h, sender, timer, entry, size, sdir ) == -1 ) {
+			fprintf(stderr,"AUTORESPOND: Unable to create secure log file for [%.*s].\n", 100, sender);
+			closedir(dirp);
+			return -1;
+		}
+		files_queue_expiry( sdir, timer );
+	}
+	closedir(dirp);			/* releases the lock */
+	return count < num;
+}
+
+
+
+/**********************************************************
+** rate limit index - an open addressing hash table in a memory
+** mapped file, one slot per sender holding the times of its latest
+** messages in a ring. a check costs a constant number of system
+** calls however many senders are logged. the file is locked with
+** flock() while in use and rebuilt under a new name when it has to
+** grow, so a process that opened the old file reopens it */
+
+#define INDEX_FILE	"autorespond.idx"
+#define INDEX_MAGIC	0x58495241	/* "ARIX" */
+#define INDEX_VERSION	1
+#define INDEX_MIN_SLOTS	1024
+#define INDEX_MIN_RING	8
+#define INDEX_MAX_RING	64	/*a larger num uses the files store*/
+
+typedef struct _index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t ring;			/* timestamps per slot */
+	uint32_t used;			/* slots holding a sender */
+	uint32_t reserved;
+} index_header;
+
+/* a slot is a 64 bit hash of the lower cased sender (0 = empty)
+   followed by ring 32 bit timestamps (0 = unused) */
+typedef struct _rate_index {
+	int fd;
+	unsigned char *base;
+	size_t size;
+	index_header *hdr;
+} rate_index;
+
+#define INDEX_SLOT_SIZE(ring)	(sizeof(uint64_t) + (ring) * sizeof(uint32_t))
+#define INDEX_SIZE(n, ring)	(sizeof(index_header) + (size_t)(n) * INDEX_SLOT_SIZE(ring))
+#define INDEX_HASH(ix, i)	((uint64_t *)((ix)->base + sizeof(index_header) + (size_t)(i) * INDEX_SLOT_SIZE((ix)->hdr->ring)))
+#define INDEX_TIMES(ix, i)	((uint32_t *)(INDEX_HASH(ix, i) + 1))
+
+/* a time counts if it is inside the window */
+#define INDEX_LIVE(t, timer, time_message)	((t) != 0 && (t) + (time_message) >= (timer))
+
+int index_slot_live( rate_index *ix, uint32_t i, unsigned int timer, unsigned int time_message )
+{
+	uint32_t *times = INDEX_TIMES(ix, i);
+	uint32_t j;
+
+	for ( j = 0; j < ix->hdr->ring; j++ )
+		if ( INDEX_LIVE(times[j], timer, time_message) )
+			return 1;
+	return 0;
+}
+
+/* find the slot of a sender, or claim one for it: an empty slot,
+   or one whose times have all expired. returns -1 when full */
+long index_find( rate_index *ix, uint64_t h, unsigned int timer, unsigned int time_message )
+{
+	uint32_t n = ix->hdr->nslots;
+	uint32_t i, probe;
+	long reuse = -1;
+	uint64_t *slot;
+
+	for ( probe = 0, i = h % n; probe < n; probe++, i = (i + 1) % n )
+	{
+		rate_scanned++;
+		slot = INDEX_HASH(ix, i);
+		if ( *slot == h )
+			return i;
+		if ( *slot == 0 )
+			break;
+		if ( reuse == -1 && !index_slot_live( ix, i, timer, time_message ) )
+			reuse = i;
+	}
+	if ( reuse == -1 )
+	{
+		if ( probe == n )
+			return -1;
+		reuse = i;
+		ix->hdr->used++;
+	}
+	slot = INDEX_HASH(ix, reuse);
+	*slot = h;
+	memset( slot + 1, 0, ix->hdr->ring * sizeof(uint32_t) );
+	return reuse;
+}
+
+void index_unmap( rate_index *ix )
+{
+	if ( ix->base != (unsigned char *)NULL )
+		munmap( ix->base, ix->size );
+	ix->base = (unsigned char *)NULL;
+	ix->hdr = (index_header *)NULL;
+}
+
+int index_map( rate_index *ix )
+{
+	struct stat st;
+
+	if ( fstat( ix->fd, &st ) == -1 || (size_t)st.st_size < sizeof(index_header) )
+		return -1;
+	ix->size = st.st_size;
+	ix->base = mmap( NULL, ix->size, PROT_READ | PROT_WRITE, MAP_SHARED, ix->fd, 0 );
+	if ( ix->base == MAP_FAILED )
+	{
+		ix->base = (unsigned char *)NULL;
+		return -1;
+	}
+	ix->hdr = (index_header *)ix->base;
+	if ( ix->hdr->magic != INDEX_MAGIC || ix->hdr->version != INDEX_VERSION ||
+		ix->hdr->nslots == 0 || ix->size < INDEX_SIZE(ix->hdr->nslots, ix->hdr->ring) )
+	{
+		index_unmap( ix );
+		return -1;
+	}
+	return 0;
+}
+
+/* write a new table with the live slots of the old one (if any) and
+   move it into place. the lock on the old file is kept until the
+   new one is locked, so nobody can slip in between */
+int index_rebuild( rate_index *ix, uint32_t nslots, uint32_t ring, unsigned int timer, unsigned int time_message )
+{
+	rate_index nx;
+	char tmpname[64];
+	uint32_t i, j, k, n;
+	long slot;
+	uint32_t *src, *dst;
+
+	snprintf( tmpname, sizeof(tmpname), INDEX_FILE ".%u", (unsigned int)getpid() );
+	nx.fd = open( tmpname, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+	if ( nx.fd == -1 )
+		return -1;
+	if ( flock( nx.fd, LOCK_EX ) == -1 || ftruncate( nx.fd, INDEX_SIZE(nslots, ring) ) == -1 )
+		goto fail;
+	nx.size = INDEX_SIZE(nslots, ring);
+	nx.base = mmap( NULL, nx.size, PROT_READ | PROT_WRITE, MAP_SHARED, nx.fd, 0 );
+	if ( nx.base == MAP_FAILED )
+		goto fail;
+	nx.hdr = (index_header *)nx.base;
+	nx.hdr->magic = INDEX_MAGIC;
+	nx.hdr->version = INDEX_VERSION;
+	nx.hdr->nslots = nslots;
+	nx.hdr->ring = ring;
+	nx.hdr->used = 0;
+
+	n = ix->hdr != (index_header *)NULL ? ix->hdr->nslots : 0;
+	for ( i = 0; i < n; i++ )
+	{
+		if ( *INDEX_HASH(ix, i) == 0 || !index_slot_live( ix, i, timer, time_message ) )
+			continue;
+		if ( (slot = index_find( &nx, *INDEX_HASH(ix, i), timer, time_message )) == -1 )
+			break;
+		/* keep the most recent times if the ring shrinks */
+		src = INDEX_TIMES(ix, i);
+		dst = INDEX_TIMES(&nx, slot);
+		for ( j = 0, k = 0; j < ix->hdr->ring && k < ring; j++ )
+			if ( INDEX_LIVE(src[j], timer, time_message) )
+				dst[k++] = src[j];
+	}
+
+	if ( rename( tmpname, INDEX_FILE ) == -1 )
+	{
+		index_unmap( &nx );
+		goto fail;
+	}
+	index_unmap( ix );
+	close( ix->fd );
+	*ix = nx;
+	return 0;
+
+fail:
+	close( nx.fd );
+	unlink( tmpname );
+	return -1;
+}
+
+void index_record( rate_index *ix, uint32_t i, unsigned int timer )
+{
+	uint32_t *times = INDEX_TIMES(ix, i);
+	uint32_t j, oldest = 0;
+
+	for ( j = 1; j < ix->hdr->ring; j++ )
+		if ( times[j] < times[oldest] )
+			oldest = j;
+	times[oldest] = timer;
+}
+
+/* move an existing A-file log into the index, once, when it is created */
+void index_migrate( rate_index *ix, unsigned int timer, unsigned int time_message )
+{
+	DIR * dirp;
+	struct dirent * direntp;
+	unsigned int message_time;
+	char * address;
+	char * ptr;
+	long slot;
+
+	if ( (dirp = opendir(".")) == NULL )
+		return;
+	while ( (direntp = readdir(dirp)) != NULL )
+	{
+		if ( direntp->d_name[0] != 'A' || (ptr = strchr(direntp->d_name,'.')) == NULL )
+			continue;
+		message_time = strtoul(ptr+1,NULL,10);
+		if ( INDEX_LIVE(message_time, timer, time_message) &&
+			(address = read_file(direntp->d_name)) != NULL )
+		{
+			slot = index_find( ix, sender_hash(address), timer, time_message );
+			if ( slot == -1 && index_rebuild( ix, ix->hdr->nslots * 2, ix->hdr->ring, timer, time_message ) == 0 )
+				slot = index_find( ix, sender_hash(address), timer, time_message );
+			if ( slot != -1 )
+				index_record( ix, slot, message_time );
+			free(address);
+		}
+		unlink(direntp->d_name);
+	}
+	closedir(dirp);
+}
+
+/* open and lock the index, creating it (and migrating any A-files) if needed */
+int index_open( rate_index *ix, uint32_t ring, unsigned int timer, unsigned int time_message )
+{
+	struct stat st, cur;
+
+	ix->base = (unsigned char *)NULL;
+	ix->hdr = (index_header *)NULL;
+	for ( ;; )
+	{
+		ix->fd = open( INDEX_FILE, O_RDWR | O_CREAT, 0600 );
+		if ( ix->fd == -1 )
+			return -1;
+		if ( flock( ix->fd, LOCK_EX ) == -1 || fstat( ix->fd, &st ) == -1 )
+		{
+			close( ix->fd );
+			return -1;
+		}
+		/* the file may have been replaced while we waited for the lock */
+		if ( stat( INDEX_FILE, &cur ) == 0 && cur.st_ino == st.st_ino && cur.st_dev == st.st_dev )
+			break;
+		close( ix->fd );
+	}
+
+	if ( st.st_size == 0 || index_map( ix ) == -1 )
+	{
+		if ( index_rebuild( ix, INDEX_MIN_SLOTS, ring, timer, time_message ) == -1 )
+		{
+			close( ix->fd );
+			return -1;
+		}
+		index_migrate( ix, timer, time_message );
+	} else if ( ix->hdr->ring < ring )
+	{
+		if ( index_rebuild( ix, ix->hdr->nslots, ring, timer, time_message ) == -1 )
+		{
+			index_unmap( ix );
+			close( ix->fd );
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void index_close( rate_index *ix )
+{
+	index_unmap( ix );
+	close( ix->fd );		/* releases the lock */
+}
+
+/**********************************************************
+** rate_limit_index - check and log a reply to the sender in one step
+** under the index lock: returns 1 and logs the reply if fewer than
+** num replies were logged within time_message seconds, 0 otherwise,
+** -1 if the index can't be used */
+
+int rate_limit_index( char *sender, unsigned int timer, unsigned int time_message, unsigned int num )
+{
+	rate_index ix;
+	uint32_t ring, i, count;
+	uint32_t *times;
+	uint64_t h;
+	long slot;
+
+	/* only the latest num times are needed: num rounded up to even,
+	   which keeps the 64 bit hashes of the slots aligned. it is at
+	   most INDEX_MAX_RING, see rate_store_files() */
+	ring = num < INDEX_MIN_RING ? INDEX_MIN_RING : (num + 1) & ~1U;
+
+	if ( index_open( &ix, ring, timer, time_message ) == -1 )
+	{
+		fprintf(stderr,"AUTORESPOND: Unable to open rate limit index for [%.*s].\n", 100, sender);
+		return -1;
+	}
+
+	h = sender_hash( sender );
+	/* at 70% load rebuild, dropping senders whose times have all expired,
+	   and double the table if at least half of it is still live */
+	if ( ix.hdr->used * 10 >= ix.hdr->nslots * 7 )
+	{
+		for ( i = 0, count = 0; i < ix.hdr->nslots; i++ )
+			if ( *INDEX_HASH(&ix, i) != 0 && index_slot_live( &ix, i, timer, time_message ) )
+				count++;
+		index_rebuild( &ix, count * 2 >= ix.hdr->nslots ? ix.hdr->nslots * 2 : ix.hdr->nslots,
+			ix.hdr->ring, timer, time_message );
+	}
+	if ( (slot = index_find( &ix, h, timer, time_message )) == -1 )
+	{
+		index_close( &ix );
+		fprintf(stderr,"AUTORESPOND: Rate limit index is full for [%.*s].\n", 100, sender);
+		return -1;
+	}
+
+	times = INDEX_TIMES(&ix, slot);
+	for ( i = 0, count = 0; i < ix.hdr->ring; i++ )
+		if ( INDEX_LIVE(times[i], timer, time_message) )
+			count++;
+	if ( count < num )
+		index_record( &ix, slot, timer );
+
+	index_close( &ix );
+	return count < num;
+}
+
+/**********************************************************
+** rate_unlog_index - take back a reply logged by rate_limit_index()
+** when it could not be sent */
+
+void rate_unlog_index( char *sender, unsigned int timer, unsigned int time_message )
+{
+	rate_index ix;
+	uint32_t n, i, probe, j;
+	uint32_t *times;
+	uint64_t h;
+
+	if ( index_open( &ix, INDEX_MIN_RING, timer, time_message ) == -1 )
+		return;
+	h = sender_hash( sender );
+	n = ix.hdr->nslots;
+	for ( probe = 0, i = h % n; probe < n && *INDEX_HASH(&ix, i) != 0; probe++, i = (i + 1) % n )
+	{
+		if ( *INDEX_HASH(&ix, i) != h )
+			continue;
+		times = INDEX_TIMES(&ix, i);
+		for ( j = 0; j < ix.hdr->ring; j++ )
+			if ( times[j] == timer ) {
+				times[j] = 0;
+				break;
+			}
+		break;
+	}
+	index_close( &ix );
+}
+
+
+
+/**********************************************************
+** rate_store_files - whether the log is kept in the files store: if
+** $AUTORESPOND_STORE=files asks for it, or if num is more times than
+** a slot of the index keeps, where every delivery would map and every
+** rebuild copy INDEX_MIN_SLOTS slots of num times each */
+
+int rate_store_files( unsigned int num )
+{
+	char *ptr = getenv( "AUTORESPOND_STORE" );
+
+	return ( ptr != NULL && strcmp( ptr, "files" ) == 0 ) || num > INDEX_MAX_RING;
+}
+
+
+
+/**********************************************************
+** gc_main - autorespond --gc time dir
+** collect the expired entries of a log directory out of the delivery
+** path, e.g. from cron: the files store is swept completely and the
+** index is rebuilt without expired senders, shrinking if it can */
+
+int gc_main( int argc, char **argv )
+{
+	unsigned int time_message, timer, live, nslots, i;
+	rate_index ix;
+	char *dir;
+
+	if ( argc != 4 ) {
+		fprintf(stderr, "\nautorespond: usage: --gc time dir\n\n");
+		_exit(111);
+	}
+	time_message = strtoul(argv[2],NULL,10);
+	dir = argv[3];
+	if ( !validate_directory_path(dir) || chdir(dir) == -1 ) {
+		fprintf(stderr,"AUTORESPOND: Failed to change into directory.\n");
+		_exit(111);
+	}
+	timer = time(NULL);
+
+	if ( access( GC_DIR, F_OK ) == 0 )
+		fprintf(stderr,"AUTORESPOND: gc visited %u senders.\n", files_gc( timer, time_message, 0 ));
+
+	if ( access( INDEX_FILE, F_OK ) == 0 )
+	{
+		if ( index_open( &ix, INDEX_MIN_RING, timer, time_message ) == -1 ) {
+			fprintf(stderr,"AUTORESPOND: Unable to open rate limit index.\n");
+			_exit(111);
+		}
+		for ( i = 0, live = 0; i < ix.hdr->nslots; i++ )
+			if ( *INDEX_HASH(&ix, i) != 0 && index_slot_live( &ix, i, timer, time_message ) )
+				live++;
+		for ( nslots = INDEX_MIN_SLOTS; nslots < live * 2; nslots *= 2 )
+			;
+		if ( index_rebuild( &ix, nslots, ix.hdr->ring, timer, time_message ) == -1 ) {
+			index_close( &ix );
+			fprintf(stderr,"AUTORESPOND: Unable to rebuild rate limit index.\n");
+			_exit(111);
+		}
+		index_close( &ix );
+		fprintf(stderr,"AUTORESPOND: gc kept %u senders in %u index slots.\n", live, nslots);
+	}
+	_exit(0);
+	return 0;
+}
+
+
+
+/**********************************************************
+** daemon mode - autorespond --daemon socket
+** takes deliveries from autorespond-client on a UNIX socket. the
+** filters are built once, then each delivery runs in a child of the
+** daemon, costing a fork instead of an exec and a rebuild.
+** request: "<length>\n" and length bytes of NUL terminated strings:
+**   the number of arguments and the arguments, the number of
+**   environment entries and the entries as NAME=value, the working
+**   directory; then the message until the client shuts down its side
+** reply: the stderr of the delivery, a NUL, the exit code as a byte */
+
+#define DAEMON_MAX_REQUEST	65536
+#define DAEMON_MAX_ARGS		16
+
+/* environment a delivery gets from qmail-local, see the list at the top */
+static char *daemon_env[] = { "SENDER", "NEWSENDER", "RECIPIENT", "USER", "HOME", "HOST",
+	"LOCAL", "EXT", "DTLINE", "RPLINE", (char *)NULL };
+
+int read_all(int fd, char * buf, size_t len)
+{
+ssize_t r;
+
+	while(len > 0) {
+		r = read(fd, buf, len);
+		if(r == -1 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* the next string of a request, NULL past the end */
+char *daemon_field( char **p, char *end )
+{
+	char *f = *p;
+
+	if ( f >= end )
+		return (char *)NULL;
+	*p = f + strlen(f) + 1;
+	return f;
+}
+
+void daemon_serve( int conn )
+{
+	char line[16];
+	char *req, *p, *end, *f;
+	char *args[DAEMON_MAX_ARGS + 2];
+	unsigned long len;
+	unsigned int i, n;
+	unsigned char reply[2];
+	int wstat, fd;
+	pid_t pid;
+
+	reply[0] = '\0';
+	reply[1] = 111;
+
+	/*the length, one byte at a time so the message is left in the socket*/
+	for ( i = 0; i < sizeof(line) - 1; i++ )
+		if ( read_all( conn, &line[i], 1 ) == -1 || line[i] == '\n' )
+			break;
+	line[i] = '\0';
+	len = strtoul( line, NULL, 10 );
+	if ( len == 0 || len > DAEMON_MAX_REQUEST )
+		goto fail;
+	req = (char *)safe_malloc( len + 1 );
+	if ( read_all( conn, req, len ) == -1 )
+		goto fail;
+	req[len] = '\0';
+	p = req;
+	end = req + len;
+
+	if ( (f = daemon_field( &p, end )) == NULL || (n = strtoul( f, NULL, 10 )) > DAEMON_MAX_ARGS )
+		goto fail;
+	args[0] = "autorespond";
+	for ( i = 1; i <= n; i++ )
+		if ( (args[i] = daemon_field( &p, end )) == NULL )
+			goto fail;
+	args[i] = (char *)NULL;
+
+	for ( i = 0; daemon_env[i] != NULL; i++ )
+		unsetenv( daemon_env[i] );
+	if ( (f = daemon_field( &p, end )) == NULL )
+		goto fail;
+	for ( i = strtoul( f, NULL, 10 ); i > 0; i-- )
+		if ( (f = daemon_field( &p, end )) == NULL || strchr( f, '=' ) == NULL || putenv( f ) != 0 )
+			goto fail;
+
+	if ( (f = daemon_field( &p, end )) == NULL || chdir( f ) == -1 )
+		goto fail;
+
+	pid = fork();
+	if ( pid == -1 )
+		goto fail;
+	if ( pid == 0 )
+	{
+		/*the worker: the message on stdin, stderr back to the client*/
+		fd = open( "/dev/null", O_RDWR );
+		dup2( conn, 0 );
+		dup2( fd, 1 );
+		dup2( conn, 2 );
+		close( fd );
+		close( conn );
+		_exit( n > 0 && strcmp( args[1], "--cdb" ) == 0 ? cdb_main( n + 1, args ) : deliver( n + 1, args ) );
+	}
+	while ( waitpid( pid, &wstat, 0 ) == -1 )
+		if ( errno != EINTR )
+			goto fail;
+	reply[1] = WIFEXITED(wstat) ? WEXITSTATUS(wstat) : 111;
+
+fail:
+	if ( write( conn, reply, 2 ) != 2 )
+		_exit(111);
+}
+
+int daemon_main( int argc, char **argv )
+{
+	struct sockaddr_un addr;
+	int sock, conn;
+	pid_t pid;
+
+	if ( argc != 3 || strlen( argv[2] ) >= sizeof(addr.sun_path) ) {
+		fprintf(stderr, "\nautorespond: usage: --daemon socket\n\n");
+		_exit(111);
+	}
+
+	/*build everything a delivery would build*/
+	domain_trie_init();
+	ac_init();
+	rules_init();
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, argv[2] );
+	unlink( argv[2] );
+	umask( 077 );			/*only our own user may connect*/
+	if ( (sock = socket( AF_UNIX, SOCK_STREAM, 0 )) == -1 ||
+		bind( sock, (struct sockaddr *)&addr, sizeof(addr) ) == -1 || listen( sock, 128 ) == -1 ) {
+		fprintf(stderr, "AUTORESPOND: Unable to listen on %s: %s.\n", argv[2], strerror(errno));
+		_exit(111);
+	}
+	signal( SIGCHLD, SIG_IGN );		/*no zombies*/
+	signal( SIGPIPE, SIG_IGN );
+
+	for ( ;; )
+	{
+		if ( (conn = accept( sock, NULL, NULL )) == -1 )
+			continue;
+		pid = fork();
+		if ( pid == 0 )
+		{
+			close( sock );
+			signal( SIGCHLD, SIG_DFL );
+			daemon_serve( conn );
+			_exit(0);
+		}
+		close( conn );
+	}
+	return 0;
+}
+
+
+
+/**********************************************************
+** cdb_main - autorespond --cdb file
+** one .qmail-default for many addresses: the arguments of each come
+** from a cdb built by autorespond-mkcdb, looked up by EXT@HOST, then
+** RECIPIENT, then @HOST. a message ":name" is the template stored
+** in the cdb under that name */
+
+int cdb_main( int argc, char **argv )
+{
+	char key[512];
+	char *args[8], *ext, *host, *value, *p, *end, *nul;
+	size_t len, i;
+	int n, k;
+
+	if ( argc != 3 ) {
+		fprintf(stderr, "\nautorespond: usage: --cdb file\n\n");
+		_exit(111);
+	}
+	if ( cdb_open( &config_cdb, argv[2] ) == -1 ) {
+		fprintf(stderr, "AUTORESPOND: Unable to read %s.\n", argv[2]);
+		_exit(111);
+	}
+	ext = getenv( "EXT" );
+	host = getenv( "HOST" );
+	value = (char *)NULL;
+	for ( k = 0; k < 3 && value == (char *)NULL; k++ )
+	{
+		if ( k == 0 && ext != (char *)NULL && host != (char *)NULL )
+			len = snprintf( key, sizeof(key), "%s@%s", ext, host );
+		else if ( k == 1 && (p = getenv( "RECIPIENT" )) != (char *)NULL )
+			len = snprintf( key, sizeof(key), "%s", p );
+		else if ( k == 2 && host != (char *)NULL )
+			len = snprintf( key, sizeof(key), "@%s", host );
+		else
+			continue;
+		if ( len >= sizeof(key) )
+			continue;
+		for ( i = 0; i < len; i++ )
+			key[i] = tolower( (unsigned char)key[i] );
+		value = cdb_find( &config_cdb, key, len, &len );
+	}
+	if ( value == (char *)NULL ) {
+		fprintf(stderr, "AUTORESPOND: No autoresponder for %s@%s.\n", ext ? ext : "", host ? host : "");
+		_exit(0);
+	}
+
+	/*the arguments, each ended by a NUL*/
+	args[0] = argv[0];
+	for ( n = 1, p = value, end = value + len; p < end && n < 7; n++, p = nul + 1 )
+	{
+		if ( (nul = memchr( p, '\0', end - p )) == (char *)NULL ) {
+			fprintf(stderr, "AUTORESPOND: Bad entry for %s in %s.\n", key, argv[2]);
+			_exit(111);
+		}
+		args[n] = p;
+	}
+	args[n] = (char *)NULL;
+	return deliver( n, args );
+}
+
+
+
+/**********************************************************
+** batch_main - autorespond --batch maildir|mbox time num message dir [ flag arsender ]
+** runs the delivery of every message of a Maildir (new/ and cur/) or an
+** mbox, for restoring service after an outage. the filters and the
+** template are built once; workers, one per CPU ($AUTORESPOND_WORKERS),
+** each take the senders whose hash falls to them, so the messages of a
+** sender are handled in order, each in a child of its worker as in
+** daemon mode. the rate limit is already under a lock; injections into
+** qmail-queue are serialised on dir/BATCH_LOCK. the message's SENDER is
+** its Return-Path, or the address on the mbox From_ line */
+
+#define BATCH_LOCK	"autorespond.batch.lock"
+
+typedef struct _batch_msg {
+	char *path;			/*Maildir: the file*/
+	size_t off;			/*mbox: where it is in the mapping*/
+	size_t len;
+	char *sender;
+} batch_msg;
+
+static batch_msg *batch = (batch_msg *)NULL;
+static size_t batch_count = 0, batch_size = 0;
+
+/* what --batch prepares once for every delivery */
+static input *batch_input = (input *)NULL;
+static template *batch_template = (template *)NULL;
+
+void batch_add( char *path, size_t off, size_t len, const char *sender, size_t sender_len )
+{
+	batch_msg *m;
 
-/**********************************************************
-** print header chain for deguging ***/
+	if ( batch_count == batch_size )
+	{
+		batch_size = batch_size ? batch_size * 2 : 1024;
+		batch = (batch_msg *)safe_realloc( batch, batch_size * sizeof(batch_msg) );
+	}
+	m = &batch[batch_count++];
+	m->path = path;
+	m->off = off;
+	m->len = len;
+	m->sender = (char *)safe_malloc( sender_len + 1 );
+	memcpy( m->sender, sender, sender_len );
+	m->sender[sender_len] = '\0';
+}
 
-void print_header_chain(void)
+/* the Return-Path of a header block, "" if there is none */
+const char *batch_return_path( const char *p, size_t n, size_t *len )
 {
-	headers *act_header;
+	const char *end = p + n, *nl, *lt, *gt;
+
+	while ( p < end && *p != '\n' && !(*p == '\r' && p + 1 < end && p[1] == '\n') )
+	{
+		if ( (nl = memchr( p, '\n', end - p )) == (char *)NULL )
+			nl = end;
+		if ( nl - p > 12 && strncasecmp( p, "Return-Path:", 12 ) == 0
+			&& (lt = memchr( p, '<', nl - p )) != (char *)NULL
+			&& (gt = memchr( lt, '>', nl - lt )) != (char *)NULL )
+		{
+			*len = gt - lt - 1;
+			return lt + 1;
+		}
+		p = nl + 1;
+	}
+	*len = 0;
+	return "";
+}
+
+int batch_names( const struct dirent *d )
+{
+	return d->d_name[0] != '.';
+}
+
+void batch_maildir( const char *maildir )
+{
+	static char *subdirs[] = { "new", "cur", NULL };
+	char path[PATH_MAX], head[8192], *file;
+	struct dirent **names;
+	const char *sender;
+	size_t len;
+	ssize_t r;
+	int i, j, n, fd;
+
+	for ( i = 0; subdirs[i] != NULL; i++ )
+	{
+		snprintf( path, sizeof(path), "%s/%s", maildir, subdirs[i] );
+		if ( (n = scandir( path, &names, batch_names, alphasort )) == -1 )
+			continue;
+		for ( j = 0; j < n; j++ )
+		{
+			len = strlen( path ) + strlen( names[j]->d_name ) + 2;
+			file = (char *)safe_malloc( len );
+			snprintf( file, len, "%s/%s", path, names[j]->d_name );
+			free( names[j] );
+			if ( (fd = open( file, O_RDONLY )) == -1 )
+			{
+				free( file );
+				continue;
+			}
+			r = read( fd, head, sizeof(head) );
+			close( fd );
+			sender = batch_return_path( head, r > 0 ? (size_t)r : 0, &len );
+			batch_add( file, 0, 0, sender, len );
+		}
+		free( names );
+	}
+}
+
+/* the messages of an mbox, each after its From_ line */
+void batch_mbox( char *map, size_t size )
+{
+	char *p = map, *end = map + size, *line_end, *next, *sender, *sp;
+
+	while ( end - p >= 5 && strncmp( p, "From ", 5 ) == 0 )
+	{
+		if ( (line_end = memchr( p, '\n', end - p )) == (char *)NULL )
+			break;
+		sender = p + 5;
+		sp = memchr( sender, ' ', line_end - sender );
+		/* the next From_ line, or the end */
+		for ( next = line_end; ; next++ )
+		{
+			if ( (next = memchr( next, '\n', end - next )) == (char *)NULL || end - next <= 5 )
+			{
+				next = end;
+				break;
+			}
+			if ( strncmp( next + 1, "From ", 5 ) == 0 )
+			{
+				next++;
+				break;
+			}
+		}
+		batch_add( (char *)NULL, line_end + 1 - map, next - (line_end + 1),
+			sender, (sp ? sp : line_end) - sender );
+		/* qmail writes an empty sender as MAILER-DAEMON */
+		if ( strcmp( batch[batch_count - 1].sender, "MAILER-DAEMON" ) == 0 )
+			batch[batch_count - 1].sender[0] = '\0';
+		p = next;
+	}
+}
+
+/* the messages of a Maildir or an mbox; the mbox mapping, NULL for a
+   Maildir. private: the deliveries unfold headers in place */
+char *batch_load( char *path )
+{
+	struct stat st;
+	char *map = (char *)NULL;
+	int fd;
+
+	if ( stat( path, &st ) == -1 ) {
+		fprintf(stderr, "AUTORESPOND: Unable to read %s: %s.\n", path, strerror(errno));
+		_exit(111);
+	}
+	if ( S_ISDIR(st.st_mode) )
+		batch_maildir( path );
+	else if ( st.st_size > 0 )
+	{
+		if ( (fd = open( path, O_RDONLY )) == -1 ||
+			(map = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 )) == MAP_FAILED ) {
+			fprintf(stderr, "AUTORESPOND: Unable to read %s.\n", path);
+			_exit(111);
+		}
+		close( fd );
+		batch_mbox( map, st.st_size );
+	}
+	return map;
+}
+
+/* the message as input: its file, or where it is in the mbox */
+int batch_open( input *in, batch_msg *m, char *map )
+{
+	int fd;
+
+	if ( map == (char *)NULL )
+	{
+		if ( (fd = open( m->path, O_RDONLY )) == -1 )
+			return -1;
+		input_open( in, fd );
+		return 0;
+	}
+	memset( in, 0, sizeof(*in) );
+	in->fd = -1;
+	in->mapped = 1;
+	in->eof = 1;
+	in->base = map + m->off;
+	in->len = m->len;
+	in->total = m->len;
+	if ( in->len == 0 || in->base[in->len - 1] != '\n' )
+	{
+		/* no room to end a header in place */
+		in->base = (char *)safe_malloc( in->len + 1 );
+		memcpy( in->base, map + m->off, in->len );
+		in->base[in->len++] = '\n';
+	}
+	return 0;
+}
+
+void batch_close( input *in, batch_msg *m, char *map )
+{
+	if ( map == (char *)NULL )
+	{
+		if ( in->mapped )
+			munmap( in->base, in->len );
+		else
+			free( in->base );
+		close( in->fd );
+	} else if ( in->base != map + m->off )
+		free( in->base );
+}
+
+/* one worker: its share of the messages, in order */
+void batch_worker( int worker, int workers, int argc, char **argv, char *map, unsigned long *counts )
+{
+	input in;
+	size_t i;
+	pid_t pid, r;
+	int wstat, code;
+
+	for ( i = 0; i < batch_count; i++ )
+	{
+		if ( sender_hash( batch[i].sender ) % workers != (uint64_t)worker )
+			continue;
+		pid = fork();
+		if ( pid == 0 )
+		{
+			setenv( "SENDER", batch[i].sender, 1 );
+			if ( batch_open( &in, &batch[i], map ) == -1 )
+				_exit(111);
+			batch_input = &in;
+			_exit( deliver( argc - 2, argv + 2 ) );
+		}
+		code = 111;
+		if ( pid != -1 )
+		{
+			while ( (r = waitpid( pid, &wstat, 0 )) == -1 && errno == EINTR )
+				;
+			if ( r != -1 )
+				code = WIFEXITED(wstat) ? WEXITSTATUS(wstat) : 111;
+		}
+		__sync_fetch_and_add( &counts[code == 0 ? 0 : code == 99 ? 1 : code == 100 ? 2 : 3], 1 );
+	}
+	_exit(0);
+}
+
+int batch_main( int argc, char **argv )
+{
+	template message;
+	struct timespec start, stop;
+	unsigned long *counts;
+	char *map, *e;
+	long workers;
+	int i, wstat;
+	pid_t pid;
+
+	if ( argc < 7 || argc > 9 ) {
+		fprintf(stderr, "\nautorespond: usage: --batch maildir|mbox time num message dir [ flag arsender ]\n\n");
+		_exit(111);
+	}
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	map = batch_load( argv[2] );
+
+	/*build everything a delivery would build*/
+	domain_trie_init();
+	ac_init();
+	rules_init();
+	if ( tpl_load( &message, argv[5] ) == -1 ) {
+		fprintf(stderr, "AUTORESPOND: Failed to open message file.\n");
+		_exit(111);
+	}
+	batch_template = &message;
+
+	workers = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( (e = getenv( "AUTORESPOND_WORKERS" )) != (char *)NULL && *e != '\0' )
+		workers = strtol( e, NULL, 10 );
+	if ( workers < 1 )
+		workers = 1;
+	if ( (size_t)workers > batch_count )
+		workers = batch_count ? batch_count : 1;
+
+	counts = mmap( NULL, 4 * sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if ( counts == MAP_FAILED ) {
+		fprintf(stderr, "AUTORESPOND: Unable to start the workers.\n");
+		_exit(111);
+	}
+	memset( counts, 0, 4 * sizeof(unsigned long) );
+	for ( i = 0; i < workers; i++ )
+	{
+		if ( (pid = fork()) == -1 ) {
+			fprintf(stderr, "AUTORESPOND: Unable to start the workers.\n");
+			_exit(111);
+		}
+		if ( pid == 0 )
+			batch_worker( i, workers, argc, argv, map, counts );
+	}
+	while ( wait( &wstat ) != -1 || errno == EINTR )
+		;
+
+	clock_gettime( CLOCK_MONOTONIC, &stop );
+	fprintf(stderr, "AUTORESPOND: Batch of %lu messages in %.3f s by %ld workers: %lu delivered, %lu stopped (99), %lu bounced (100), %lu deferred (111).\n",
+		(unsigned long)batch_count, (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9, workers,
+		counts[0], counts[1], counts[2], counts[3]);
+	_exit( counts[3] ? 111 : 0 );
+	return 0;
+}
+
+
+
+/**********************************************************
+** replay_main - autorespond --replay maildir|mbox [ time num ]
+** a dry run for tuning the filters: each message of a Maildir or an
+** mbox goes through the checks of a delivery (the sender, the sender
+** lists, the rules and the rate limit, of REPLAY_TIME and REPLAY_NUM if
+** not given, in the store a delivery would use, kept in a scratch
+** directory) and nothing is sent. what was decided, and what each stage
+** and rule cost, is printed at the end */
+
+#define REPLAY_TIME	3600
+#define REPLAY_NUM	5
+
+#define REPLAY_REPLY	0
+#define REPLAY_SENDER	1
+#define REPLAY_DENIED	2
+#define REPLAY_RULE	3
+#define REPLAY_LIMIT	4
+#define REPLAY_UNREAD	5
+#define REPLAY_ERROR	6
+#define REPLAY_DECISIONS	7
+
+static char *replay_decisions[] = { "reply", "bad sender", "deny list", "rule", "rate limit", "unreadable", "error" };
+static char *replay_stages[] = { "sender", "headers", "sender lists", "rules", "rate limit" };
+
+/* empty the directory of fd, with what is under it */
+void replay_remove( int fd )
+{
+	struct dirent *d;
+	struct stat st;
+	DIR *dirp;
+	int sub;
+
+	if ( (dirp = fdopendir( fd )) == NULL )
+	{
+		close( fd );
+		return;
+	}
+	while ( (d = readdir( dirp )) != NULL )
+	{
+		if ( strcmp( d->d_name, "." ) == 0 || strcmp( d->d_name, ".." ) == 0 )
+			continue;
+		if ( fstatat( fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW ) == 0 && S_ISDIR(st.st_mode) )
+		{
+			if ( (sub = openat( fd, d->d_name, O_RDONLY | O_DIRECTORY )) != -1 )
+				replay_remove( sub );
+			unlinkat( fd, d->d_name, AT_REMOVEDIR );
+		} else
+			unlinkat( fd, d->d_name, 0 );
+	}
+	closedir( dirp );
+}
 
-	act_header = header;
+int replay_main( int argc, char **argv )
+{
+	char scratch[] = "/tmp/autorespond-replay.XXXXXX";
+	char recipient[512], *ext, *host, *sender;
+	char log_entry[64];
+	unsigned long decided[REPLAY_DECISIONS] = { 0 }, *rule_hits;
+	unsigned long long stage_ns[5] = { 0 }, t, start, elapsed;
+	unsigned int time_message = REPLAY_TIME, num = REPLAY_NUM, timer;
+	headers *h;
+	input in;
+	rule *r;
+	char *map;
+	size_t i;
+	int here, there, list, decision, store_files, limit;
+
+	if ( argc != 3 && argc != 5 ) {
+		fprintf(stderr, "\nautorespond: usage: --replay maildir|mbox [ time num ]\n\n");
+		_exit(111);
+	}
+	if ( argc == 5 ) {
+		time_message = strtoul( argv[3], NULL, 10 );
+		num = strtoul( argv[4], NULL, 10 );
+	}
+	map = batch_load( argv[2] );
+	ext = getenv( "EXT" );
+	host = getenv( "HOST" );
+	snprintf( recipient, sizeof(recipient), "%s@%s", ext ? ext : "unknown", host ? host : "localhost" );
+	if ( (here = open( ".", O_RDONLY )) == -1 || mkdtemp( scratch ) == NULL || (there = open( scratch, O_RDONLY )) == -1 ) {
+		fprintf(stderr, "AUTORESPOND: Unable to make a scratch directory: %s.\n", strerror(errno));
+		_exit(111);
+	}
 
-	while ( act_header != (headers *)NULL )
+	/*build everything first, so the first message doesn't pay for it*/
+	domain_trie_init();
+	ac_init();
+	rules_init();
+	rule_ns = (unsigned long long *)safe_malloc( rule_count * sizeof(unsigned long long) );
+	rule_tests = (unsigned long *)safe_malloc( rule_count * sizeof(unsigned long) );
+	rule_hits = (unsigned long *)safe_malloc( rule_count * sizeof(unsigned long) );
+	memset( rule_ns, 0, rule_count * sizeof(unsigned long long) );
+	memset( rule_tests, 0, rule_count * sizeof(unsigned long) );
+	memset( rule_hits, 0, rule_count * sizeof(unsigned long) );
+	timer = time( NULL );
+	store_files = rate_store_files( num );
+
+	start = clock_ns();
+	for ( i = 0; i < batch_count; i++ )
 	{
-		printf( "%s: %s", act_header->tag, act_header->content );
-		act_header = act_header->next;
+		if ( batch_open( &in, &batch[i], map ) == -1 )
+		{
+			decided[REPLAY_UNREAD]++;
+			continue;
+		}
+		sender = batch[i].sender;
+		t = clock_ns();
+		decision = REPLAY_REPLY;
+		if ( sender[0] == '\0' || strncasecmp( sender, "mailer-daemon", 13 ) == 0 || strchr( sender, '@' ) == NULL
+			|| strcmp( sender, "#@[]" ) == 0 || !validate_email_address( sender ) )
+			decision = REPLAY_SENDER;
+		stage_ns[0] += clock_ns() - t;
+		if ( decision == REPLAY_REPLY )
+		{
+			t = clock_ns();
+			read_headers( &in, NULL );
+			stage_ns[1] += clock_ns() - t;
+
+			t = clock_ns();
+			list = sender_list_check( sender, recipient, 1 );
+			stage_ns[2] += clock_ns() - t;
+			if ( list == LIST_DENY )
+				decision = REPLAY_DENIED;
+		}
+		if ( decision == REPLAY_REPLY )
+		{
+			t = clock_ns();
+			rules_allowed = list == LIST_ALLOW;
+			if ( (r = rules_match( &h )) != (rule *)NULL )
+			{
+				rule_hits[r - rules]++;
+				decision = REPLAY_RULE;
+			}
+			stage_ns[3] += clock_ns() - t;
+		}
+		if ( decision == REPLAY_REPLY )
+		{
+			t = clock_ns();
+			if ( fchdir( there ) == -1 )
+				decision = REPLAY_ERROR;
+			else if ( (limit = store_files ? rate_limit_files( sender, timer, time_message, num, log_entry, sizeof(log_entry) )
+				: rate_limit_index( sender, timer, time_message, num )) == -1 )
+				decision = REPLAY_ERROR;
+			else if ( limit == 0 )
+				decision = REPLAY_LIMIT;
+			fchdir( here );
+			stage_ns[4] += clock_ns() - t;
+		}
+		decided[decision]++;
+		batch_close( &in, &batch[i], map );
 	}
+	elapsed = clock_ns() - start;
+
+	/*the scratch log goes*/
+	replay_remove( there );
+	rmdir( scratch );
+
+	printf( "%lu messages in %.3f s, %.0f messages/s\n\n", (unsigned long)batch_count, elapsed / 1e9,
+		elapsed ? batch_count / (elapsed / 1e9) : 0.0 );
+	printf( "%-12s %10s\n", "decision", "messages" );
+	for ( i = 0; i < REPLAY_DECISIONS; i++ )
+		printf( "%-12s %10lu\n", replay_decisions[i], decided[i] );
+	printf( "\n%-12s %10s %12s\n", "stage", "ms", "ns/message" );
+	for ( i = 0; i < 5; i++ )
+		printf( "%-12s %10.3f %12.0f\n", replay_stages[i], stage_ns[i] / 1e6,
+			batch_count ? (double)stage_ns[i] / batch_count : 0.0 );
+	printf( "\n%-9s %-20s %-16s %4s %10s %10s %10s %8s\n", "rule", "header", "pattern", "exit", "tests", "decided", "ms", "ns/test" );
+	for ( i = 0; i < (size_t)rule_count; i++ )
+		printf( "%-9s %-20.*s %-16s %4d %10lu %10lu %10.3f %8.0f\n", rule_kinds[rules[i].kind],
+			(int)rules[i].tag_len, rules[i].tag, rules[i].pattern ? rules[i].pattern : "-", rules[i].code,
+			rule_tests[i], rule_hits[i], rule_ns[i] / 1e6, rule_tests[i] ? (double)rule_ns[i] / rule_tests[i] : 0.0 );
+	return 0;
 }
 
 
 
 /**********************************************************
-** regex_matches_header - Check if header matches sender filter list */
+** delivery timing
+** with $AUTORESPOND_TIMING set, a delivery logs one line as it exits:
+** what was decided and why, bytes read and written, log entries
+** scanned, and the microseconds spent in each stage, as key=value
+** pairs. the time between two stages entered, on the monotonic clock,
+** goes to the first */
+
+#define STAGE_SETUP	0	/*arguments and the reply template*/
+#define STAGE_HEADERS	1	/*reading the headers*/
+#define STAGE_FILTER	2	/*sender lists and rules*/
+#define STAGE_RATELIMIT	3	/*the log of replies*/
+#define STAGE_SPAWN	4	/*starting qmail-queue*/
+#define STAGE_RENDER	5	/*composing the reply*/
+#define STAGE_QUEUE	6	/*handing it over and waiting for qmail-queue*/
+#define STAGES		7
+
+static char *stage_names[] = { "setup", "headers", "filter", "ratelimit", "spawn", "render", "queue" };
+
+static struct {
+	int on;
+	int stage;				/*the one the clock runs for*/
+	unsigned long long start, last;
+	unsigned long long ns[STAGES];
+	char *recipient;
+	rule *rule;
+	qmail_queue *qq;
+} timing;
+
+void timing_start( void )
+{
+	char *ptr = getenv( "AUTORESPOND_TIMING" );
 
-int regex_matches_header(const char *header_str) {
-	regex_t regex;
-	int ret;
+	memset( &timing, 0, sizeof(timing) );
+	timing.on = ptr != (char *)NULL && *ptr != '\0' && strcmp( ptr, "0" ) != 0;
+	rate_scanned = 0;
+	if ( timing.on )
+		timing.start = timing.last = clock_ns();
+}
 
-	ret = regcomp(&regex, SENDER_FILTER_LIST, REG_EXTENDED | REG_ICASE);
-	if (ret) return 0; /* return 0 on regex compilation error */
+/* the time since the last stage was entered goes to it */
+void timing_enter( int stage )
+{
+	unsigned long long now;
+
+	if ( !timing.on )
+		return;
+	now = clock_ns();
+	timing.ns[timing.stage] += now - timing.last;
+	timing.last = now;
+	timing.stage = stage;
+}
 
-	ret = regexec(&regex, header_str, 0, NULL, 0);
-	regfree(&regex);
+/* exit from a delivery, logging its timing first */
+void finish( int code, char *decision )
+{
+	int i;
 
-	return (ret == 0); /* return 1 if match, 0 if no match */
+	if ( timing.on )
+	{
+		timing_enter( timing.stage );
+		fprintf( stderr, "AUTORESPOND: timing recipient=%s decision=%s exit=%d rule=",
+			timing.recipient ? timing.recipient : "-", decision, code );
+		if ( timing.rule == NULL )
+			fputc( '-', stderr );
+		else
+		{
+			/* index:kind:header[:pattern], spaces in the pattern as _
+			   so the line still splits on them */
+			fprintf( stderr, "%d:%s:%.*s", (int)(timing.rule - rules), rule_kinds[timing.rule->kind],
+				(int)timing.rule->tag_len, timing.rule->tag );
+			if ( timing.rule->pattern_len > 0 )
+			{
+				fputc( ':', stderr );
+				for ( i = 0; i < (int)timing.rule->pattern_len && i < 100; i++ )
+					fputc( isspace( (unsigned char)timing.rule->pattern[i] ) ? '_' : timing.rule->pattern[i], stderr );
+			}
+		}
+		fprintf( stderr, " bytes_in=%lu bytes_out=%lu scanned=%lu",
+			(unsigned long)message_input.total, timing.qq ? timing.qq->bytes : 0UL, rate_scanned );
+		for ( i = 0; i < STAGES; i++ )
+			fprintf( stderr, " %s_us=%llu", stage_names[i], timing.ns[i] / 1000 );
+		fprintf( stderr, " total_us=%llu\n", (clock_ns() - timing.start) / 1000 );
+	}
+	_exit( code );
 }
 
 
 
 /**********************************************************
-** main */
+** deliver - handle one delivered message, as run from .qmail */
 
-int main(int argc, char ** argv)
+int deliver(int argc, char ** argv)
 {
 char * sender;
 
-char * message;
+template message;
+template head;
+qmail_queue qq;
 unsigned int time_message;
 unsigned int timer;
 unsigned int num;
@@ -835,19 +4370,17 @@ char * message_filename;
 char * dir;
 
 char * ptr;
-char * my_delivered_to;
-
-DIR * dirp;
-struct dirent * direntp;
-unsigned int message_time;
-char * address;
-unsigned int count;
-char filename[512];
-FILE * f;
+rule * matched_rule;
+headers * matched_header;
+int list;
+int lock_fd;
+char * decision;
+
+int store_files;
+int limit;
+char log_entry[64];
 unsigned int message_handling = DEFAULT_MH;
-char buffer[512];
 char buffer2[512];
-char *content_boundary;
 char *rpath = DEFAULT_FROM;
 char *TheUser;
 char *TheDomain;
@@ -866,9 +4399,20 @@ char *TheDomain;
 		fprintf(stderr, "arsender - from address in generated message, or:\n\n");
 		fprintf(stderr, "+ = blank from envelope !\n");
 		fprintf(stderr, "$ = To: address will be used\n\n");
+		fprintf(stderr, "autorespond --gc time dir\n\n");
+		fprintf(stderr, "removes the expired entries of the log in dir\n\n");
+		fprintf(stderr, "autorespond --daemon socket\n\n");
+		fprintf(stderr, "serves autorespond-client deliveries on a UNIX socket\n\n");
+		fprintf(stderr, "autorespond --batch maildir|mbox time num message dir [ flag arsender ]\n\n");
+		fprintf(stderr, "runs the above for every message of a Maildir or an mbox\n\n");
+		fprintf(stderr, "autorespond --replay maildir|mbox [ time num ]\n\n");
+		fprintf(stderr, "reports what would be done with every message, sending nothing\n\n");
+		fprintf(stderr, "autorespond --cdb file\n\n");
+		fprintf(stderr, "takes the arguments for EXT@HOST from a cdb made by autorespond-mkcdb\n\n");
 		_exit(111);
 	}
 
+	timing_start();
 	TheUser= getenv("EXT");
 	TheDomain= getenv("HOST");
 
@@ -883,7 +4427,7 @@ char *TheDomain;
 
 	if(argc > 7 || argc < 5) {
 		fprintf(stderr, "AUTORESPOND: Invalid arguments. (%d)\n",argc);
-		_exit(111);
+		finish(111, "error");
 	}
 
 	time_message     = strtoul(argv[1],NULL,10);
@@ -899,35 +4443,34 @@ char *TheDomain;
 	/* Validate directory path to prevent directory traversal */
 	if (!validate_directory_path(dir)) {
 		fprintf(stderr, "AUTORESPOND: Invalid directory path.\n");
-		_exit(111);
+		finish(111, "error");
 	}
 
 	/* Validate message handling parameter */
 	if (message_handling > 1) {
 		fprintf(stderr, "AUTORESPOND: Invalid message handling flag.\n");
-		_exit(111);
+		finish(111, "error");
 	}
 
+	/*the address the message came to*/
+	snprintf(buffer2, sizeof(buffer2), "%s@%s", TheUser, TheDomain);
 	if ( *rpath == '+' )
 		rpath = "";
 	if ( *rpath == '$' )
-	{
-		snprintf(buffer2, sizeof(buffer2), "%s@%s", TheUser, TheDomain);
 		rpath = buffer2;
-	}
+	timing.recipient = buffer2;
 
 	timer = time(NULL);
 
-	/*prepare the "delivered-to" string*/
-	my_delivered_to = "Delivered-To: Autoresponder\n";
-
-	read_headers( stdin );
-
-
-	message = read_file(message_filename);
-	if(message==NULL) {
+	/*the headers we add, then the message file*/
+	head.text = "Delivered-To: Autoresponder\nTo: %{sender}\nX-Original-From: %{arsender}\nX-Original-Subject: Re:%{subject}\n";
+	head.len = strlen(head.text);
+	tpl_parse(&head);
+	if(batch_template != NULL)
+		message = *batch_template;
+	else if(tpl_load(&message, message_filename) == -1) {
 		fprintf(stderr, "AUTORESPOND: Failed to open message file.\n");
-		_exit(111);
+		finish(111, "error");
 	}
 
 	/*don't autorespond in certain situations*/
@@ -939,257 +4482,169 @@ char *TheDomain;
 	if( sender[0]==0 || strncasecmp(sender,"mailer-daemon",13)==0 || strchr(sender,'@')==NULL || strcmp(sender,"#@[]")==0 ) {
 		/*exit with success and continue parsing .qmail file*/
 		fprintf(stderr,"AUTORESPOND:  Stopping on mail from [%.*s].\n", 100, sender);
-		_exit(0);
+		finish(0, "bad-sender");
 	}
 
 	/* Validate sender email address */
 	if (!validate_email_address(sender)) {
 		fprintf(stderr, "AUTORESPOND: Invalid sender email address format.\n");
-		_exit(0);
-	}
-
-
-	if ( inspect_headers("mailing-list", (char *)NULL ) != (char *)NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: This looks like it's from a mailing list, I will ignore it.\n");
-		_exit(0);			/*report success and exit*/
-	}
-	if ( inspect_headers("Delivered-To", "Autoresponder" ) != (char *)NULL )
-	{
-		/*got one of my own messages...*/
-		fprintf(stderr,"AUTORESPOND: This message is looping...it has my Delivered-To header.\n");
-		_exit(100);			/*hard error*/
-	}
-	if ( inspect_headers("precedence", "junk" ) != (char *)NULL ||
-		 inspect_headers("precedence", "bulk" ) != (char *)NULL ||
-		 inspect_headers("precedence", "list" ) != (char *)NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: Junk mail received.\n");
-		_exit(0); /* don't reply to bulk, junk, or list mail */
-	}
-
-	/* Check for List-Id header */
-	if ( inspect_headers("list-id", (char *)NULL ) != (char *)NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: Message has List-Id header, ignoring.\n");
-		_exit(0);
-	}
-
-	/* Check for List-Unsubscribe header */
-	if ( inspect_headers("list-unsubscribe", (char *)NULL ) != (char *)NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: Message has List-Unsubscribe header, ignoring.\n");
-		_exit(0);
-	}
-
-	/* Check for X-Report-Abuse-To header. This is most commonly associated with
-	transactional messages, although it is used by a very small number of boutique email
-	hosting providers. There will be false positives. */
-	if ( inspect_headers("x-report-abuse-to", (char *)NULL ) != (char *)NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: Message has X-Report-Abuse-To header, ignoring.\n");
-		_exit(0);
-	}
-
-	/* Check for X-Patreon-UUID header */
-	if ( inspect_headers("x-patreon-uuid", (char *)NULL ) != (char *)NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: Message has X-Patreon-UUID header, ignoring.\n");
-		_exit(0);
-	}
-
-	/* Check for X-Mailgun-Tag header */
-	if ( inspect_headers("x-mailgun-tag", (char *)NULL ) != (char *)NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: Message has X-Mailgun-Tag header, ignoring.\n");
-		_exit(0);
-	}
-
-	/* Check X-Spam-Level for asterisks */
-	ptr = inspect_headers("x-spam-level", (char *)NULL );
-	if ( ptr != NULL && strchr( ptr, '*' ) != NULL )
-	{
-		fprintf(stderr,"AUTORESPOND: X-Spam-Level header contains asterisk, ignoring: %s.\n", ptr);
-		_exit(0);
-	}
-
-	/* Check for CLI-based mail agents */
-	ptr = inspect_headers("user-agent", (char *)NULL );
-	if ( ptr != NULL && (strstr( ptr, "mailx" ) != NULL || strstr( ptr, "s-nail" ) != NULL) )
-	{
-		fprintf(stderr,"AUTORESPOND: User-Agent header contains CLI-based mail agent, ignoring: %s.\n", ptr);
-		_exit(0);
+		finish(0, "bad-sender");
 	}
 
-	/* Check Sender header against filter list */
-	ptr = inspect_headers("sender", (char *)NULL );
-	if ( ptr != NULL && regex_matches_header( ptr ) )
-	{
-		fprintf(stderr,"AUTORESPOND: Sender header matches filter list, ignoring: %s.\n", ptr);
-		_exit(0);
-	}
 
-	/* Check From header against filter list */
-	ptr = inspect_headers("from", (char *)NULL );
-	if ( ptr != NULL && regex_matches_header( ptr ) )
+	/*the first rule that matches decides: the first listed, or with
+	  $AUTORESPOND_EARLY_EXIT the first to match as the headers are
+	  read, which stops reading there. a sender on the deny list gets
+	  no reply, one on the allow list is not stopped by rules that
+	  exit 0 (loops still are); early, only SENDER can allow*/
+	timing_enter( STAGE_FILTER );
+	rules_init();
+	timing_enter( STAGE_HEADERS );
+	if ( batch_input != (input *)NULL )
+		message_input = *batch_input;
+	else
+		input_open( &message_input, 0 );
+	ptr = getenv("AUTORESPOND_EARLY_EXIT");
+	if ( ptr != (char *)NULL && *ptr != '\0' && strcmp( ptr, "0" ) != 0 )
 	{
-		fprintf(stderr,"AUTORESPOND: From header matches filter list, ignoring: %s.\n", ptr);
-		_exit(0);
-	}
-
-	/* Check Reply-To header against filter list */
-	ptr = inspect_headers("reply-to", (char *)NULL );
-	if ( ptr != NULL && regex_matches_header( ptr ) )
+		/*the rules are timed with the headers here*/
+		timing_enter( STAGE_FILTER );
+		if ( (list = sender_list_check( sender, buffer2, 0 )) == LIST_DENY )
+			finish(0, "deny");
+		rules_allowed = list == LIST_ALLOW;
+		matched_rule = (rule *)NULL;
+		timing_enter( STAGE_HEADERS );
+		if ( read_headers( &message_input, rules_check_header ) )
+		{
+			matched_rule = stream_rule;
+			matched_header = stream_header;
+		} else
+		{
+			timing_enter( STAGE_FILTER );
+			if ( sender_list_check( sender, buffer2, 1 ) == LIST_DENY )
+				finish(0, "deny");
+		}
+	} else
 	{
-		fprintf(stderr,"AUTORESPOND: Reply-To header matches filter list, ignoring: %s.\n", ptr);
-		_exit(0);
+		read_headers( &message_input, NULL );
+		timing_enter( STAGE_FILTER );
+		if ( (list = sender_list_check( sender, buffer2, 1 )) == LIST_DENY )
+			finish(0, "deny");
+		rules_allowed = list == LIST_ALLOW;
+		matched_rule = rules_match( &matched_header );
 	}
-
-	/* Check Return-Path header against filter list */
-	ptr = inspect_headers("return-path", (char *)NULL );
-	if ( ptr != NULL && regex_matches_header( ptr ) )
+	if ( matched_rule != (rule *)NULL )
 	{
-		fprintf(stderr,"AUTORESPOND: Return-Path header matches filter list, ignoring: %s.\n", ptr);
-		_exit(0);
+		timing.rule = matched_rule;
+		rule_log( matched_rule, matched_header );
+		finish( matched_rule->code, "rule" );
 	}
 
 	/*check the logs*/
+	timing_enter( STAGE_RATELIMIT );
 	if(chdir(dir) == -1) {
 		fprintf(stderr,"AUTORESPOND: Failed to change into directory.\n");
-		_exit(111);
+		finish(111, "error");
 	}
 
-	/* Verify we're in the expected directory and add entry */
+	/* Verify we're in the expected directory */
 	{
 		char cwd_buffer[PATH_MAX];
-		int log_fd;
 
 		if (!getcwd(cwd_buffer, sizeof(cwd_buffer))) {
 			fprintf(stderr,"AUTORESPOND: Unable to verify current directory.\n");
-			_exit(111);
-		}
-
-		/*add entry*/
-		log_fd = create_secure_temp_file(filename, sizeof(filename), "A");
-		if(log_fd == -1) {
-			fprintf(stderr,"AUTORESPOND: Unable to create secure log file for [%.*s].", 100, sender);
-			_exit(111);
-		}
-		f = fdopen(log_fd, "wb");
-		if(f==NULL) {
-			fprintf(stderr,"AUTORESPOND: Unable to open log file stream for [%.*s].", 100, sender);
-			close(log_fd);
-			unlink(filename);
-			_exit(111);
-		}
-		if(fwrite(sender,1,strlen(sender),f)!=strlen(sender)) {
-			fprintf(stderr,"AUTORESPOND: Unable to create file for [%.*s].", 100, sender);
-			fclose(f);
-			unlink(filename);
-			_exit(111);
-		}
-		fclose(f);
-	}
-
-	/*check if there are too many responses in the logs*/
-	dirp = opendir(".");
-	count = 0;
-	while((direntp = readdir(dirp)) != NULL) {
-		if(direntp->d_name[0] != 'A')
-			continue;
-		ptr = strchr(direntp->d_name,'.');
-		if(ptr==NULL)
-			continue;
-		message_time = strtoul(ptr+1,NULL,10);
-		if(message_time < timer-time_message) {
-			/*too old..ignore errors on unlink*/
-			unlink(direntp->d_name);
-		} else {
-			address = read_file(direntp->d_name);
-			if(address==NULL) {
-				/*ignore this?*/
-				continue;
-			}
-			if(strcasecmp(address,sender)==0) {
-				count++;
-			}
-			free(address);
+			finish(111, "error");
 		}
 	}
 
-	if(count>num) {
+	/*check there were not too many responses in the logs and log this one,
+	  $AUTORESPOND_STORE=files (or a large num) keeps a one file per message log*/
+	store_files = rate_store_files( num );
+	limit = store_files ? rate_limit_files( sender, timer, time_message, num, log_entry, sizeof(log_entry) )
+		: rate_limit_index( sender, timer, time_message, num );
+	if ( limit == -1 )
+		finish(111, "error");
+	if ( limit == 0 )
+	{
 		fprintf(stderr,"AUTORESPOND: too many received from [%.*s]\n", 100, sender);
-		_exit(0); /* don't reply to this message, but allow it to be delivered */
+		finish(0, "rate-limit"); /* don't reply to this message, but allow it to be delivered */
 	}
 
-	/* Create temporary file for response */
+	/* Stream the response into qmail-queue, one at a time in a batch
+	   (the lock goes with the process) */
 	{
-		int temp_fd;
-
-		temp_fd = create_secure_temp_file(filename, sizeof(filename), "tmp");
-		if(temp_fd == -1) {
-			fprintf(stderr,"AUTORESPOND: Unable to create secure temporary file.\n");
-			_exit(111);
-		}
-		f = fdopen(temp_fd, "wb");
-		if(f==NULL) {
-			fprintf(stderr,"AUTORESPOND: Unable to open temporary file stream.\n");
-			close(temp_fd);
-			unlink(filename);
-			_exit(111);
+		timing_enter( STAGE_SPAWN );
+		if ( batch_template != (template *)NULL && (lock_fd = open( BATCH_LOCK, O_RDWR | O_CREAT, 0600 )) != -1 )
+			flock( lock_fd, LOCK_EX );
+		if ( qmail_queue_open( &qq, rpath, sender ) == -1 )
+		{
+			if ( store_files )
+				unlink( log_entry );
+			else
+				rate_unlog_index( sender, timer, time_message );
+			finish(111, "failed");
 		}
-
-		fprintf( f, "%sTo: %s\nX-Original-From: %s\nX-Original-Subject: Re:%s\n%s\n",
-			my_delivered_to, sender, rpath, inspect_headers( "Subject", (char *) NULL ), message );
+		timing.qq = &qq;
+
+		timing_enter( STAGE_RENDER );
+		tpl_values[TPL_SENDER] = sender;
+		tpl_values[TPL_RECIPIENT] = buffer2;
+		tpl_values[TPL_ARSENDER] = rpath;
+		tpl_values[TPL_SUBJECT] = tpl_header( "Subject" );
+		tpl_values[TPL_DATE] = tpl_header( "Date" );
+		tpl_values[TPL_MESSAGE_ID] = tpl_header( "Message-ID" );
+		tpl_render( &qq, &head );
+		tpl_render( &qq, &message );
+		qq_puts( &qq, "\n" );
 
 		if ( message_handling == 1 ) {
-			fprintf( f, "%s\n\n", "-------- Original Message --------" );
-			if ( (content_boundary = get_content_boundary()) == (char *)NULL )
-			{
-				while ( fgets( buffer, sizeof(buffer), stdin ) != NULL )
-				{
-					fputs( "> ", f );
-					fputs( buffer, f );
-				}
-			} else
-			{
-				int content_found = 0;
-				while ( fgets( buffer, sizeof(buffer), stdin ) != NULL )
-				{
-					if ( content_found == 1 )
-					{
-						if ( strstr( buffer, content_boundary ) != (char *)NULL )
-							break;
-						fputs( "> ", f );
-						fputs( buffer, f );
-					}
-					if ( strstr( buffer, content_boundary ) != (char *)NULL )
-					{
-						if ( content_found == 1 )
-							break;
-						else
-						{
-							free_headers();
-							read_headers( stdin );
-							if ( inspect_headers("Content-Type", "text/plain" ) != (char *)NULL )
-								content_found = 1;
-							continue;
-						}
-					}
-				}
-			}
+			qq_puts( &qq, "-------- Original Message --------\n\n" );
+			quote_original( &qq, &message_input );
 		}
 
-		fprintf( f, "\n\n" );
+		qq_puts( &qq, "\n\n" );
 
-		fclose( f );
-
-		/*send the autoresponse...ignore errors?*/
-		send_message(filename,rpath,&sender,1);
+		/*send the autoresponse, a reply that failed doesn't count*/
+		timing_enter( STAGE_QUEUE );
+		decision = "reply";
+		if ( send_message(&qq,rpath,&sender,1) == -1 )
+		{
+			decision = "failed";
+			if ( store_files )
+				unlink( log_entry );
+			else
+				rate_unlog_index( sender, timer, time_message );
+		}
 
-		unlink( filename );
+		/*collect a few expired entries while we are here*/
+		timing_enter( STAGE_RATELIMIT );
+		if ( store_files )
+			files_gc( timer, time_message, GC_BUDGET );
 	}
 
-	_exit(0);
+	finish(0, decision);
 	return 0;					/*compiler warning squelch*/
 }
+
+
+
+/**********************************************************
+** main */
+
+#ifndef AUTORESPOND_NO_MAIN
+int main(int argc, char ** argv)
+{
+	if ( argc > 1 && strcmp( argv[1], "--gc" ) == 0 )
+		return gc_main( argc, argv );
+	if ( argc > 1 && strcmp( argv[1], "--daemon" ) == 0 )
+		return daemon_main( argc, argv );
+	if ( argc > 1 && strcmp( argv[1], "--cdb" ) == 0 )
+		return cdb_main( argc, argv );
+	if ( argc > 1 && strcmp( argv[1], "--batch" ) == 0 )
+		return batch_main( argc, argv );
+	if ( argc > 1 && strcmp( argv[1], "--replay" ) == 0 )
+		return replay_main( argc, argv );
+
+	return deliver( argc, argv );
+}
+#endif
@@ -0,0 +1,552 @@
+/*
+	autorespond-bench - microbenchmarks for autorespond
+
+	Builds autorespond.c without its main() and times pieces of the
+	work done for every delivered message, on a corpus it makes up:
+	a short personal mail, header-heavy bulk mail, a multipart message
+	with large attachments and one with long folded headers. Reports
+	ns and allocations per operation for reading the headers, looking
+	them up, the rules and the sender filter, the rate limit at several
+	log sizes, and the time from exec to exit of autorespond-bench-exec,
+	an autorespond whose qmail-queue is a stub.
+
+	Usage:
+
+			autorespond-bench [ iterations ]
+
+	Not installed; "make bench" builds and runs it.
+*/
+
+#define _GNU_SOURCE			/*for nftw()*/
+#define AUTORESPOND_NO_MAIN
+#include "autorespond.c"
+
+#include <stdarg.h>
+#include <ftw.h>
+
+#define BENCH_ITERATIONS 200000
+#define BENCH_EXEC_RUNS 200
+
+/* allocations, counted by wrapping glibc's malloc */
+#ifdef __GLIBC__
+extern void *__libc_malloc( size_t );
+extern void *__libc_calloc( size_t, size_t );
+extern void *__libc_realloc( void *, size_t );
+
+static unsigned long bench_allocs = 0;
+
+void *malloc( size_t n )
+{
+	bench_allocs++;
+	return __libc_malloc( n );
+}
+
+void *calloc( size_t n, size_t size )
+{
+	bench_allocs++;
+	return __libc_calloc( n, size );
+}
+
+void *realloc( void *p, size_t n )
+{
+	bench_allocs++;
+	return __libc_realloc( p, n );
+}
+#else
+static unsigned long bench_allocs = 0;		/*not counted*/
+#endif
+
+/* header contents of the sizes inspect_headers() sees */
+static char *bench_haystacks[] = {
+	"Re: Quarterly numbers for the Northwind account, second draft",
+	"multipart/alternative; boundary=\"000000000000a1b2c3d4e5f6a7b8c9d0\"",
+	"from mail-ej1-f41.google.com (mail-ej1-f41.google.com [209.85.218.41]) by mx.example.net "
+		"(Postfix) with ESMTPS id 4T3kQ81Zx2z9sWw for <user@example.net>; Tue, 16 Jan 2024 "
+		"09:41:12 +0100 (CET)",
+	"<https://list.example.org/mailman/options/announce>, <mailto:announce-request@list.example.org?subject=unsubscribe>",
+	"v=1; a=rsa-sha256; c=relaxed/relaxed; d=example.com; s=20230601; t=1705394471; x=1705999271; "
+		"darn=example.net; h=to:subject:message-id:date:from:mime-version:from:to:cc:subject:date:"
+		"message-id:reply-to; bh=47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=; b=dGhpcyBpcyBub3Qg"
+		"YSByZWFsIHNpZ25hdHVyZSwganVzdCBzb21lIGJ5dGVzIHRvIG1ha2UgdGhlIGhlYWRlciBhcyBsb25nIGFzIGEg"
+		"cmVhbCBvbmUsIHNvIHRoYXQgdGhlIHNlYXJjaCBoYXMgc29tZXRoaW5nIHRvIGNoZXcgb24gZm9yIGEgd2hpbGU=",
+	(char *)NULL
+};
+
+/* what autorespond looks for in them */
+static char *bench_needles[] = { "boundary=", "junk", "bulk", "mailx", "Autoresponder", "yes", (char *)NULL };
+
+/* the search autorespond used to do: lower cased copies of both strings */
+char *old_strcasestr2( char *_s1, char *_s2 )
+{
+	char *s1;
+	char *s2;
+	char *ptr;
+	char *result = NULL;
+
+	s1 = strdup(_s1);
+	if (s1 == NULL) {
+		return NULL;
+	}
+
+	s2 = strdup(_s2);
+	if (s2 == NULL) {
+		free(s1);
+		return NULL;
+	}
+
+	for ( ptr = s1; *ptr != '\0'; ptr++ )
+		*ptr = tolower( *ptr );
+
+	for ( ptr = s2; *ptr != '\0'; ptr++ )
+		*ptr = tolower( *ptr );
+
+	ptr = strstr( s1, s2 );
+
+	if ( ptr != (char *)NULL )
+		result = _s1 + (ptr - s1);
+
+	free(s1);
+	free(s2);
+
+	return result;
+}
+
+static char *bench_old( const char *hay, size_t hay_len, const char *needle, size_t n )
+{
+	(void)hay_len;
+	(void)n;
+	return old_strcasestr2( (char *)hay, (char *)needle );
+}
+
+double now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ns per search over every haystack and needle */
+double bench_search( casesearch_fn fn, long iterations )
+{
+	volatile uintptr_t sink = 0;
+	double start;
+	long it;
+	int h, n, searches = 0;
+
+	for ( h = 0; bench_haystacks[h] != NULL; h++ )
+		for ( n = 0; bench_needles[n] != NULL; n++ )
+		{
+			/* every variant has to agree with the plain scalar search */
+			if ( fn( bench_haystacks[h], strlen( bench_haystacks[h] ), bench_needles[n], strlen( bench_needles[n] ) )
+				!= casesearch_scalar( bench_haystacks[h], strlen( bench_haystacks[h] ), bench_needles[n], strlen( bench_needles[n] ) ) )
+			{
+				fprintf( stderr, "autorespond-bench: search disagrees on \"%s\"\n", bench_needles[n] );
+				_exit( 1 );
+			}
+			searches++;
+		}
+
+	start = now_ns();
+	for ( it = 0; it < iterations; it++ )
+		for ( h = 0; bench_haystacks[h] != NULL; h++ )
+			for ( n = 0; bench_needles[n] != NULL; n++ )
+				sink += (uintptr_t)fn( bench_haystacks[h], strlen( bench_haystacks[h] ), bench_needles[n], strlen( bench_needles[n] ) );
+	(void)sink;
+	return (now_ns() - start) / ((double)iterations * searches);
+}
+
+void report_search( const char *name, casesearch_fn fn, long iterations, double old )
+{
+	double ns = bench_search( fn, iterations );
+
+	printf( "  %-24s %8.1f ns/op", name, ns );
+	if ( old > 0 )
+		printf( "  %5.1fx", old / ns );
+	printf( "\n" );
+}
+
+/**********************************************************
+** the corpus */
+
+typedef struct _corpus {
+	const char *name;
+	char *text;
+	size_t len;
+	size_t size;
+	size_t headers;			/*length of the header block*/
+} corpus;
+
+void corpus_printf( corpus *c, const char *fmt, ... )
+{
+	va_list ap;
+	int n;
+
+	for ( ;; )
+	{
+		va_start( ap, fmt );
+		n = vsnprintf( c->text + c->len, c->size - c->len, fmt, ap );
+		va_end( ap );
+		if ( (size_t)n < c->size - c->len )
+			break;
+		c->size = (c->size + n) * 2;
+		c->text = (char *)safe_realloc( c->text, c->size );
+	}
+	c->len += n;
+}
+
+/* a line of base64 looking text */
+void corpus_base64( corpus *c, size_t bytes )
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for ( i = 0; i < bytes; i++ )
+	{
+		corpus_printf( c, "%c", b64[(i * 7 + i / 76) & 63] );
+		if ( i % 76 == 75 )
+			corpus_printf( c, "\n" );
+	}
+	corpus_printf( c, "\n" );
+}
+
+void corpus_received( corpus *c, int n, int folded )
+{
+	int i;
+
+	for ( i = 0; i < n; i++ )
+		corpus_printf( c, "Received: from relay%d.example.org (relay%d.example.org [192.0.2.%d])%s"
+			"by mx%d.example.net (Postfix) with ESMTPS id 4T3kQ8%04dz9sWw%s"
+			"for <user@example.net>; Tue, 16 Jan 2024 09:41:%02d +0100 (CET)\n",
+			i, i, i, folded ? "\n\t" : " ", i, i, folded ? "\n\t" : " ", i % 60 );
+}
+
+void corpus_make( corpus *c, int kind )
+{
+	int i;
+
+	memset( c, 0, sizeof(*c) );
+	switch ( kind )
+	{
+	case 0:
+		c->name = "personal";
+		corpus_printf( c, "Return-Path: <john@personal-email.com>\n" );
+		corpus_received( c, 2, 0 );
+		corpus_printf( c, "Date: Tue, 16 Jan 2024 09:41:12 +0100\nFrom: John Doe <john@personal-email.com>\n"
+			"To: help@example.net\nSubject: Question about my order\nMessage-ID: <1234@personal-email.com>\n"
+			"MIME-Version: 1.0\nContent-Type: text/plain; charset=utf-8\n\n" );
+		for ( i = 0; i < 15; i++ )
+			corpus_printf( c, "Line %d of a short personal message, asking about an order.\n", i );
+		break;
+	case 1:
+		c->name = "bulk";
+		corpus_printf( c, "Return-Path: <bounce-4711@news.example.com>\n" );
+		corpus_received( c, 6, 0 );
+		corpus_printf( c, "DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed; d=news.example.com; s=s1;\n"
+			"\th=from:to:subject:date:list-unsubscribe; bh=47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=;\n"
+			"\tb=dGhpcyBpcyBub3QgYSByZWFsIHNpZ25hdHVyZSwganVzdCBzb21lIGJ5dGVzIHRvIG1ha2UgdGhlIGhlYWRl\n" );
+		for ( i = 0; i < 3; i++ )
+			corpus_printf( c, "ARC-Seal: i=%d; a=rsa-sha256; t=1705394471; cv=none; d=example.net; s=arc;\n"
+				"\tb=YSByZWFsIHNpZ25hdHVyZSwganVzdCBzb21lIGJ5dGVzIHRvIG1ha2UgdGhlIGhlYWRlciBhcyBsb25n\n", i + 1 );
+		for ( i = 0; i < 20; i++ )
+			corpus_printf( c, "X-Campaign-Field-%d: value %d of the campaign tracking data\n", i, i );
+		corpus_printf( c, "Date: Tue, 16 Jan 2024 09:41:12 +0100\nFrom: News <news@news.example.com>\n"
+			"To: help@example.net\nSubject: This week's offers\nMessage-ID: <4711@news.example.com>\n"
+			"List-Id: <offers.news.example.com>\n"
+			"List-Unsubscribe: <https://news.example.com/u/4711>, <mailto:unsubscribe@news.example.com>\n"
+			"List-Unsubscribe-Post: List-Unsubscribe=One-Click\nPrecedence: bulk\n"
+			"MIME-Version: 1.0\nContent-Type: text/html; charset=utf-8\n\n" );
+		for ( i = 0; i < 300; i++ )
+			corpus_printf( c, "<p>Offer %d: something you did not ask for, at a price you will like.</p>\n", i );
+		break;
+	case 2:
+		c->name = "multipart";
+		corpus_printf( c, "Return-Path: <mary@personal-email.com>\n" );
+		corpus_received( c, 3, 0 );
+		corpus_printf( c, "Date: Tue, 16 Jan 2024 09:41:12 +0100\nFrom: Mary <mary@personal-email.com>\n"
+			"To: help@example.net\nSubject: The documents\nMessage-ID: <5678@personal-email.com>\n"
+			"MIME-Version: 1.0\nContent-Type: multipart/mixed; boundary=\"b1_0123456789\"\n\n"
+			"--b1_0123456789\nContent-Type: text/plain; charset=utf-8\n\nThe documents are attached.\n" );
+		for ( i = 0; i < 2; i++ )
+		{
+			corpus_printf( c, "--b1_0123456789\nContent-Type: application/pdf\n"
+				"Content-Disposition: attachment; filename=\"document%d.pdf\"\nContent-Transfer-Encoding: base64\n\n", i );
+			corpus_base64( c, 256 * 1024 );
+		}
+		corpus_printf( c, "--b1_0123456789--\n" );
+		break;
+	default:
+		c->name = "folded";
+		corpus_printf( c, "Return-Path: <alice@personal-email.com>\n" );
+		corpus_received( c, 30, 1 );
+		corpus_printf( c, "References:" );
+		for ( i = 0; i < 200; i++ )
+			corpus_printf( c, "\n\t<message-%d.%d@lists.example.org>", i, i * 31 );
+		corpus_printf( c, "\nDate: Tue, 16 Jan 2024 09:41:12 +0100\nFrom: Alice <alice@personal-email.com>\n"
+			"To: help@example.net\nSubject: Re: Re: Re: Re: a thread that went on\n for a long time\n"
+			"Message-ID: <9999@personal-email.com>\n\nShort reply.\n" );
+		break;
+	}
+	c->headers = strstr( c->text, "\n\n" ) + 2 - c->text;
+}
+
+/* an input over memory, as a mapped message is */
+void bench_input( input *in, char *text, size_t len )
+{
+	memset( in, 0, sizeof(*in) );
+	in->fd = -1;
+	in->mapped = 1;
+	in->eof = 1;
+	in->base = text;
+	in->len = len;
+}
+
+void report( const char *what, const char *name, double ns, unsigned long allocs, long ops )
+{
+	printf( "  %-16s %-12s %10.1f ns/op %8.2f allocs/op\n", what, name, ns, (double)allocs / ops );
+}
+
+/**********************************************************
+** the headers: read, looked up, checked by the rules */
+
+void bench_headers( corpus *c, long iterations )
+{
+	static char *lookups[][2] = { { "Subject", NULL }, { "Content-Type", NULL }, { "Precedence", "bulk" },
+		{ "Mailing-List", NULL }, { "List-Id", NULL }, { "X-Spam-Level", "*" }, { NULL, NULL } };
+	char *work = (char *)safe_malloc( c->headers + 1 );
+	volatile uintptr_t sink = 0;
+	unsigned long allocs;
+	double start, spent;
+	headers *h;
+	input in;
+	long it;
+	int i;
+
+	/* reading leaves the message as it is: the whole message */
+	bench_input( &in, c->text, c->len );
+	read_headers( &in, NULL );
+	allocs = bench_allocs;
+	start = now_ns();
+	for ( it = 0; it < iterations; it++ )
+	{
+		bench_input( &in, c->text, c->len );
+		read_headers( &in, NULL );
+	}
+	report( "read_headers", c->name, (now_ns() - start) / iterations, bench_allocs - allocs, iterations );
+
+	/* lookups unfold in place: a fresh copy of the headers each time */
+	allocs = bench_allocs;
+	spent = 0;
+	for ( it = 0; it < iterations; it++ )
+	{
+		memcpy( work, c->text, c->headers );
+		bench_input( &in, work, c->headers );
+		read_headers( &in, NULL );
+		start = now_ns();
+		for ( i = 0; lookups[i][0] != NULL; i++ )
+			sink += (uintptr_t)inspect_headers( lookups[i][0], lookups[i][1] );
+		spent += now_ns() - start;
+	}
+	report( "inspect_headers", c->name, spent / iterations, bench_allocs - allocs, iterations );
+
+	allocs = bench_allocs;
+	spent = 0;
+	for ( it = 0; it < iterations; it++ )
+	{
+		memcpy( work, c->text, c->headers );
+		bench_input( &in, work, c->headers );
+		read_headers( &in, NULL );
+		start = now_ns();
+		sink += (uintptr_t)rules_match( &h );
+		spent += now_ns() - start;
+	}
+	report( "rules_match", c->name, spent / iterations, bench_allocs - allocs, iterations );
+
+	/* the sender filter on the From address */
+	memcpy( work, c->text, c->headers );
+	bench_input( &in, work, c->headers );
+	read_headers( &in, NULL );
+	h = header_find( "From" );
+	allocs = bench_allocs;
+	start = now_ns();
+	for ( it = 0; it < iterations; it++ )
+		sink += sender_filter_matches( header_content( h ) );
+	report( "sender filter", c->name, (now_ns() - start) / iterations, bench_allocs - allocs, iterations );
+	(void)sink;
+	free( work );
+}
+
+/**********************************************************
+** the rate limit, with as many senders logged as given */
+
+int bench_remove( const char *path, const struct stat *st, int flag, struct FTW *ftw )
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove( path );
+}
+
+void bench_rate_limit( int files, unsigned int logged, long iterations )
+{
+	char dir[] = "/tmp/autorespond-bench.XXXXXX";
+	char sender[64], name[32], entry[64];
+	unsigned int timer = time( NULL ), i;
+	unsigned long allocs;
+	double start;
+	long it;
+	int here;
+
+	if ( (here = open( ".", O_RDONLY )) == -1 || mkdtemp( dir ) == NULL || chdir( dir ) == -1 )
+	{
+		fprintf( stderr, "autorespond-bench: no scratch directory\n" );
+		_exit( 1 );
+	}
+	for ( i = 0; i < logged; i++ )
+	{
+		snprintf( sender, sizeof(sender), "logged%u@example.com", i );
+		if ( files )
+			rate_limit_files( sender, timer, 3600, 5, entry, sizeof(entry) );
+		else
+			rate_limit_index( sender, timer, 3600, 5 );
+	}
+	allocs = bench_allocs;
+	start = now_ns();
+	for ( it = 0; it < iterations; it++ )
+	{
+		/* half of them new senders, half ones that are logged */
+		if ( it & 1 )
+			snprintf( sender, sizeof(sender), "logged%u@example.com", (unsigned int)(it % logged) );
+		else
+			snprintf( sender, sizeof(sender), "new%ld@example.com", it );
+		if ( files )
+			rate_limit_files( sender, timer, 3600, 5, entry, sizeof(entry) );
+		else
+			rate_limit_index( sender, timer, 3600, 5 );
+	}
+	snprintf( name, sizeof(name), "%u logged", logged );
+	report( files ? "rate limit files" : "rate limit index", name, (now_ns() - start) / iterations,
+		bench_allocs - allocs, iterations );
+	if ( fchdir( here ) == -1 )
+		_exit( 1 );
+	close( here );
+	nftw( dir, bench_remove, 16, FTW_DEPTH | FTW_PHYS );
+}
+
+/**********************************************************
+** a whole delivery, from exec to exit */
+
+int bench_compare( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void bench_exec( corpus *c, int runs )
+{
+	char dir[] = "/tmp/autorespond-bench.XXXXXX";
+	char message[PATH_MAX], sender[64];
+	double *took, start, sum = 0;
+	pid_t pid;
+	int i, fd, wstat;
+
+	if ( access( "./autorespond-bench-exec", X_OK ) == -1 )
+	{
+		printf( "  (no ./autorespond-bench-exec, build it with make autorespond-bench-exec)\n" );
+		return;
+	}
+	if ( mkdtemp( dir ) == NULL )
+		_exit( 1 );
+	snprintf( message, sizeof(message), "%s/message", dir );
+	if ( (fd = open( message, O_WRONLY | O_CREAT, 0600 )) == -1 || write( fd, c->text, c->len ) != (ssize_t)c->len )
+		_exit( 1 );
+	close( fd );
+	took = (double *)safe_malloc( runs * sizeof(double) );
+	setenv( "EXT", "help", 1 );
+	setenv( "HOST", "example.net", 1 );
+	setenv( "LOCAL", "help", 1 );
+	for ( i = 0; i < runs; i++ )
+	{
+		snprintf( sender, sizeof(sender), "exec%d@personal-email.com", i );
+		setenv( "SENDER", sender, 1 );
+		start = now_ns();
+		pid = fork();
+		if ( pid == 0 )
+		{
+			fd = open( message, O_RDONLY );
+			dup2( fd, 0 );
+			fd = open( "/dev/null", O_WRONLY );
+			dup2( fd, 2 );
+			execl( "./autorespond-bench-exec", "autorespond", "3600", "5", "help_message", dir, "1", "$", (char *)NULL );
+			_exit( 111 );
+		}
+		while ( waitpid( pid, &wstat, 0 ) == -1 && errno == EINTR )
+			;
+		/* a delivery that failed is not timing autorespond */
+		if ( pid == -1 || !WIFEXITED(wstat) || WEXITSTATUS(wstat) != 0 )
+		{
+			if ( pid != -1 && WIFEXITED(wstat) )
+				printf( "  %-16s %-12s (a delivery exited %d, run from the source directory)\n",
+					"exec to exit", c->name, WEXITSTATUS(wstat) );
+			else
+				printf( "  %-16s %-12s (a delivery did not exit)\n", "exec to exit", c->name );
+			free( took );
+			nftw( dir, bench_remove, 16, FTW_DEPTH | FTW_PHYS );
+			return;
+		}
+		took[i] = (now_ns() - start) / 1000;
+		sum += took[i];
+	}
+	qsort( took, runs, sizeof(double), bench_compare );
+	printf( "  %-16s %-12s %10.1f us mean %8.1f us p50 %8.1f us p99\n", "exec to exit", c->name,
+		sum / runs, took[runs / 2], took[runs * 99 / 100] );
+	free( took );
+	nftw( dir, bench_remove, 16, FTW_DEPTH | FTW_PHYS );
+}
+
+int main( int argc, char **argv )
+{
+	long iterations = BENCH_ITERATIONS;
+	corpus corpora[4];
+	double old;
+	unsigned int logged;
+	int i;
+
+	if ( argc > 1 )
+		iterations = atol( argv[1] );
+	if ( iterations <= 0 )
+		iterations = BENCH_ITERATIONS;
+
+	printf( "case-insensitive search, %ld rounds\n", iterations );
+	old = bench_search( bench_old, iterations );
+	printf( "  %-24s %8.1f ns/op\n", "strdup+strstr (old)", old );
+	report_search( "scalar", casesearch_scalar, iterations, old );
+#ifdef CASESEARCH_SIMD
+	report_search( "sse2", casesearch_sse2, iterations, old );
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
+		report_search( "avx2", casesearch_avx2, iterations, old );
+#endif
+
+	domain_trie_init();
+	ac_init();
+	rules_init();
+	for ( i = 0; i < 4; i++ )
+		corpus_make( &corpora[i], i );
+
+	printf( "\nheaders, %ld rounds\n", iterations / 20 );
+	for ( i = 0; i < 4; i++ )
+		bench_headers( &corpora[i], iterations / 20 );
+
+	printf( "\nrate limit, %ld rounds\n", iterations / 200 );
+	for ( logged = 100; logged <= 10000; logged *= 10 )
+		bench_rate_limit( 0, logged, iterations / 200 );
+	for ( logged = 100; logged <= 10000; logged *= 10 )
+		bench_rate_limit( 1, logged, iterations / 200 );
+
+	printf( "\ndelivery, %d runs\n", BENCH_EXEC_RUNS );
+	bench_exec( &corpora[0], BENCH_EXEC_RUNS );
+	bench_exec( &corpora[2], BENCH_EXEC_RUNS );
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+	autorespond-stress - many deliveries at once against one log directory
+
+	Runs deliveries of the same message from a number of senders, so
+	many at a time, all against one rate limit directory, the way a mail
+	storm on one alias does. Reports the throughput and the latency of
+	the deliveries, and checks from what they logged that no sender got
+	more than num replies within time seconds.
+
+	Usage:
+
+			autorespond-stress [ deliveries senders concurrency [ time num ] ]
+
+		the deliveries are run by ./autorespond-bench-exec, whose
+		qmail-queue is a stub. $AUTORESPOND_STORE is passed on, so
+		either store can be put under load.
+
+	Not installed; "make stress" builds and runs it.
+
+	Exit codes:
+	0 - OK
+	1 - a sender got more replies than allowed, a delivery failed
+	    (exited 111 or other) or none replied, or the run failed
+*/
+
+#define _GNU_SOURCE			/*for nftw()*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <limits.h>
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define STRESS_BIN		"./autorespond-bench-exec"
+#define STRESS_DELIVERIES	2000
+#define STRESS_SENDERS		20
+#define STRESS_CONCURRENCY	200
+#define STRESS_TIME		3600
+#define STRESS_NUM		5
+
+static const char stress_message[] =
+	"Return-Path: <storm@example.com>\n"
+	"Date: Tue, 16 Jan 2024 09:41:12 +0100\n"
+	"From: Storm <storm@example.com>\n"
+	"To: help@example.net\n"
+	"Subject: Where is my order?\n"
+	"Message-ID: <storm@example.com>\n"
+	"\n"
+	"Still waiting.\n";
+
+static const char stress_reply[] =
+	"Subject: We got your message\n"
+	"\n"
+	"We will answer it soon.\n";
+
+typedef struct _running {
+	pid_t pid;
+	double start;
+} running;
+
+void fail( const char *why, const char *what )
+{
+	fprintf( stderr, "autorespond-stress: %s%s%s.\n", why, what ? ": " : "", what ? what : "" );
+	_exit( 1 );
+}
+
+void *safe_malloc( size_t n )
+{
+	void *p;
+
+	if ( (p = malloc( n )) == NULL )
+		fail( "out of memory", NULL );
+	return p;
+}
+
+double now_us( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void write_file( const char *path, const char *text )
+{
+	int fd;
+
+	if ( (fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0600 )) == -1
+		|| write( fd, text, strlen( text ) ) != (ssize_t)strlen( text ) || close( fd ) == -1 )
+		fail( "unable to write", path );
+}
+
+int remove_entry( const char *path, const struct stat *st, int flag, struct FTW *ftw )
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove( path );
+}
+
+int compare( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**********************************************************
+** one delivery: the message on stdin, what it logs appended to log */
+
+pid_t start_delivery( int n, int senders, const char *message, const char *reply, const char *dir,
+	const char *timearg, const char *numarg, int log )
+{
+	char sender[64];
+	pid_t pid;
+	int fd;
+
+	snprintf( sender, sizeof(sender), "sender%d@example.com", n % senders );
+	if ( (pid = fork()) == -1 )
+		fail( "unable to fork", strerror( errno ) );
+	if ( pid > 0 )
+		return pid;
+	setenv( "SENDER", sender, 1 );
+	if ( (fd = open( message, O_RDONLY )) == -1 || dup2( fd, 0 ) == -1 || dup2( log, 2 ) == -1 )
+		_exit( 111 );
+	execl( STRESS_BIN, "autorespond", timearg, numarg, reply, dir, "1", "$", (char *)NULL );
+	_exit( 111 );
+}
+
+/**********************************************************
+** the replies each sender got, from the "Reply sent" lines */
+
+int count_replies( const char *path, unsigned int *replies, int senders, unsigned int *total )
+{
+	FILE *f;
+	char line[1024];
+	char *p;
+	int n;
+
+	if ( (f = fopen( path, "r" )) == NULL )
+		fail( "unable to read", path );
+	*total = 0;
+	while ( fgets( line, sizeof(line), f ) != NULL )
+	{
+		if ( strncmp( line, "AUTORESPOND: Reply sent from ", 29 ) != 0 )
+			continue;
+		if ( (p = strstr( line, " to sender" )) == NULL )
+			continue;
+		n = atoi( p + 10 );
+		if ( n >= 0 && n < senders )
+			replies[n]++;
+		(*total)++;
+	}
+	fclose( f );
+	return 0;
+}
+
+/**********************************************************/
+int main( int argc, char **argv )
+{
+	char dir[] = "/tmp/autorespond-stress.XXXXXX";
+	char message[PATH_MAX], reply[PATH_MAX], logdir[PATH_MAX], logpath[PATH_MAX];
+	char timearg[16], numarg[16];
+	int deliveries = STRESS_DELIVERIES, senders = STRESS_SENDERS, concurrency = STRESS_CONCURRENCY;
+	unsigned int time_message = STRESS_TIME, num = STRESS_NUM;
+	unsigned int *replies, total, over = 0, most = 0;
+	unsigned int exited[4] = { 0, 0, 0, 0 };	/*0, 99, 111, other*/
+	running *slots;
+	double *took, start, elapsed, sum = 0;
+	int started = 0, done = 0, active = 0, i, log, wstat, failed;
+	char *store;
+	pid_t pid;
+
+	if ( argc != 1 && argc != 4 && argc != 6 )
+	{
+		fprintf( stderr, "autorespond-stress: usage: autorespond-stress [ deliveries senders concurrency [ time num ] ]\n" );
+		_exit( 1 );
+	}
+	if ( argc >= 4 )
+	{
+		deliveries = atoi( argv[1] );
+		senders = atoi( argv[2] );
+		concurrency = atoi( argv[3] );
+	}
+	if ( argc == 6 )
+	{
+		time_message = strtoul( argv[4], NULL, 10 );
+		num = strtoul( argv[5], NULL, 10 );
+	}
+	if ( deliveries < 1 || senders < 1 || concurrency < 1 || time_message < 1 || num < 1 )
+		fail( "the counts must be positive", NULL );
+	if ( access( STRESS_BIN, X_OK ) == -1 )
+		fail( "no " STRESS_BIN ", build it with make autorespond-bench-exec", NULL );
+
+	if ( mkdtemp( dir ) == NULL )
+		fail( "unable to create", dir );
+	snprintf( message, sizeof(message), "%s/message", dir );
+	snprintf( reply, sizeof(reply), "%s/reply", dir );
+	snprintf( logdir, sizeof(logdir), "%s/log", dir );
+	snprintf( logpath, sizeof(logpath), "%s/stderr", dir );
+	write_file( message, stress_message );
+	write_file( reply, stress_reply );
+	if ( mkdir( logdir, 0700 ) == -1 )
+		fail( "unable to create", logdir );
+	/* appended to by every delivery, a line is one write */
+	if ( (log = open( logpath, O_WRONLY | O_CREAT | O_APPEND, 0600 )) == -1 )
+		fail( "unable to create", logpath );
+	snprintf( timearg, sizeof(timearg), "%u", time_message );
+	snprintf( numarg, sizeof(numarg), "%u", num );
+	setenv( "EXT", "help", 1 );
+	setenv( "HOST", "example.net", 1 );
+	setenv( "LOCAL", "help", 1 );
+
+	slots = (running *)safe_malloc( concurrency * sizeof(running) );
+	took = (double *)safe_malloc( deliveries * sizeof(double) );
+	for ( i = 0; i < concurrency; i++ )
+		slots[i].pid = 0;
+
+	start = now_us();
+	while ( done < deliveries )
+	{
+		while ( active < concurrency && started < deliveries )
+		{
+			for ( i = 0; slots[i].pid != 0; i++ )
+				;
+			slots[i].start = now_us();
+			slots[i].pid = start_delivery( started++, senders, message, reply, logdir, timearg, numarg, log );
+			active++;
+		}
+		if ( (pid = wait( &wstat )) == -1 )
+		{
+			if ( errno == EINTR )
+				continue;
+			fail( "lost a delivery", strerror( errno ) );
+		}
+		for ( i = 0; i < concurrency && slots[i].pid != pid; i++ )
+			;
+		if ( i == concurrency )
+			continue;
+		took[done] = now_us() - slots[i].start;
+		sum += took[done++];
+		slots[i].pid = 0;
+		active--;
+		if ( !WIFEXITED(wstat) )
+			exited[3]++;
+		else if ( WEXITSTATUS(wstat) == 0 )
+			exited[0]++;
+		else if ( WEXITSTATUS(wstat) == 99 )
+			exited[1]++;
+		else if ( WEXITSTATUS(wstat) == 111 )
+			exited[2]++;
+		else
+			exited[3]++;
+	}
+	elapsed = now_us() - start;
+	close( log );
+
+	replies = (unsigned int *)safe_malloc( senders * sizeof(unsigned int) );
+	memset( replies, 0, senders * sizeof(unsigned int) );
+	count_replies( logpath, replies, senders, &total );
+	for ( i = 0; i < senders; i++ )
+	{
+		if ( replies[i] > num )
+			over++;
+		if ( replies[i] > most )
+			most = replies[i];
+	}
+
+	qsort( took, deliveries, sizeof(double), compare );
+	store = getenv( "AUTORESPOND_STORE" );
+	printf( "%d deliveries from %d senders, %d at a time, %s store, time %u num %u\n",
+		deliveries, senders, concurrency, store != NULL && strcmp( store, "files" ) == 0 ? "files" : "index",
+		time_message, num );
+	printf( "  %10.1f deliveries/s\n", deliveries / (elapsed / 1e6) );
+	printf( "  %10.1f us mean %8.1f us p50 %8.1f us p90 %8.1f us p99 %8.1f us max\n", sum / deliveries,
+		took[deliveries / 2], took[deliveries * 90 / 100], took[deliveries * 99 / 100], took[deliveries - 1] );
+	printf( "  exit 0: %u, 99: %u, 111: %u, other: %u\n", exited[0], exited[1], exited[2], exited[3] );
+	printf( "  %u replies, at most %u to a sender\n", total, most );
+	failed = 1;
+	if ( exited[2] + exited[3] > 0 )
+		printf( "  FAILED: %u deliveries exited 111 or other\n", exited[2] + exited[3] );
+	else if ( total == 0 )
+		printf( "  FAILED: no delivery replied\n" );
+	else if ( elapsed / 1e6 >= time_message )
+	{
+		printf( "  the run took longer than time, the limit was not checked\n" );
+		failed = 0;
+	}
+	else if ( over > 0 )
+		printf( "  FAILED: %u senders got more than %u replies\n", over, num );
+	else
+	{
+		printf( "  OK: no sender got more than %u replies\n", num );
+		failed = 0;
+	}
+
+	nftw( dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+	return failed;
+}
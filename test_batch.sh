@@ -0,0 +1,106 @@
+#!/bin/bash
+
+# Test script to verify autorespond --batch and --replay over a Maildir and an mbox
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+# Create a stub qmail-queue if needed
+if [[ ! -f /var/qmail/bin/qmail-queue ]]; then
+    echo "Creating qmail-queue stub for testing...";
+    sudo mkdir -p /var/qmail/bin;
+    echo -e '#!/bin/bash\ncat > /tmp/qmail-queue-test.eml' > /var/qmail/bin/qmail-queue;
+    chmod +x /var/qmail/bin/qmail-queue;
+fi
+
+# Set required environment variables
+export EXT="recipient";
+export HOST="example.net";
+export LOCAL="recipient";
+
+work=$(mktemp -d);
+failed=0;
+
+check() {
+    local test_name="$1";
+    local expected="$2";
+    local got="$3";
+
+    if [[ "$got" == "$expected" ]]; then
+        echo -e "${GREEN}✓ $test_name${NC}";
+    else
+        echo -e "${RED}✗ $test_name${NC}";
+        echo "  Expected: $expected";
+        echo "  Got: $got";
+        failed=1;
+    fi
+}
+
+# Run a batch over $1 with a fresh log, print the exit code and the number of replies
+batch() {
+    rm -rf "$work/logs";
+    mkdir "$work/logs";
+    ./autorespond --batch "$1" 3600 2 help_message "$work/logs" 1 '$' 2> "$work/err";
+    echo "$? $(grep -c 'Reply sent' "$work/err")";
+}
+
+echo -e "\n${YELLOW}=== Testing autorespond --batch ===${NC}\n";
+
+# 120 messages from 30 senders, every tenth is bulk mail; one bounce
+mkdir -p "$work/maildir/new" "$work/maildir/cur" "$work/maildir/tmp";
+for i in $(seq 1 120); do
+    s=$((i % 30));
+    {
+        echo "Return-Path: <sender$s@example.com>";
+        echo "From: Sender $s <sender$s@example.com>";
+        [[ $((i % 10)) == 0 ]] && echo "Precedence: bulk";
+        echo "Subject: Message $i";
+        echo;
+        echo "Body $i.";
+    } > "$work/message";
+    cp "$work/message" "$work/maildir/$([[ $i -le 60 ]] && echo cur || echo new)/$(printf '%010d' $i).$i.host";
+    echo "From sender$s@example.com Mon Jan  1 00:00:00 2024" >> "$work/mbox";
+    tail -n +2 "$work/message" >> "$work/mbox";
+    echo >> "$work/mbox";
+done
+printf 'Return-Path: <>\nFrom: Mailer <mailer-daemon@example.com>\nSubject: Bounce\n\nFailed.\n' > "$work/maildir/new/bounce";
+printf 'From MAILER-DAEMON Mon Jan  1 00:00:00 2024\nFrom: Mailer <mailer-daemon@example.com>\nSubject: Bounce\n\nFailed.\n' >> "$work/mbox";
+
+# senders 0, 10 and 20 only ever send bulk mail, the others get two replies
+check "Maildir: up to num replies per sender, none to bulk mail or bounces" "0 54" "$(batch "$work/maildir")";
+check "mbox: the same decisions" "0 54" "$(batch "$work/mbox")";
+check "three workers: the same decisions" "0 54" "$(AUTORESPOND_WORKERS=3 batch "$work/mbox")";
+check "the summary counts every message" "1" "$(grep -c 'Batch of 121 messages' "$work/err")";
+check "a missing mailbox is an error" "111 0" "$(batch "$work/nothing")";
+
+echo -e "\n${YELLOW}=== Testing autorespond --replay ===${NC}\n";
+
+# Print how many messages the last replay decided $1 for
+decided() {
+    sed -n '/^decision/,/^$/p' "$work/replay" | grep "^$1 " | awk '{print $NF}';
+}
+
+rm -f /tmp/qmail-queue-test.eml;
+./autorespond --replay "$work/maildir" 3600 2 > "$work/replay" 2>/dev/null;
+check "replay exits 0" "0" "$?";
+check "replay: replies" "54" "$(decided reply)";
+check "replay: stopped by a rule" "12" "$(decided rule)";
+check "replay: over the limit" "54" "$(decided 'rate limit')";
+check "replay: bounces" "1" "$(decided 'bad sender')";
+check "replay: the Precedence bulk rule decided them" "12" "$(grep '^contains  Precedence  *bulk' "$work/replay" | awk '{print $6}')";
+check "replay sends nothing" "no" "$([[ -f /tmp/qmail-queue-test.eml ]] && echo yes || echo no)";
+./autorespond --replay "$work/mbox" 3600 2 > "$work/replay.mbox" 2>/dev/null;
+check "replay: the mbox decides the same" "$(sed -n '3,10p' "$work/replay")" "$(sed -n '3,10p' "$work/replay.mbox")";
+AUTORESPOND_STORE=files ./autorespond --replay "$work/maildir" 3600 2 > "$work/replay.files" 2>/dev/null;
+check "replay: the files store decides the same" "$(sed -n '3,10p' "$work/replay")" "$(sed -n '3,10p' "$work/replay.files")";
+check "replay: the scratch log is removed" "" "$(ls -d /tmp/autorespond-replay.* 2>/dev/null)";
+
+# Clean up
+rm -rf "$work";
+rm -f /tmp/qmail-queue-test.eml;
+
+echo -e "\n${YELLOW}=== Test completed ===${NC}";
+exit $failed;
@@ -0,0 +1,90 @@
+#!/bin/bash
+
+# Test script to verify autorespond --cdb and autorespond-mkcdb
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+# Create a stub qmail-queue if needed
+if [[ ! -f /var/qmail/bin/qmail-queue ]]; then
+    echo "Creating qmail-queue stub for testing...";
+    sudo mkdir -p /var/qmail/bin;
+    echo -e '#!/bin/bash\ncat > /tmp/qmail-queue-test.eml' > /var/qmail/bin/qmail-queue;
+    chmod +x /var/qmail/bin/qmail-queue;
+fi
+
+work=$(mktemp -d);
+mkdir "$work/help" "$work/away";
+failed=0;
+
+printf 'Subject: Away\n\nAway, %%{sender}.\n' > "$work/away_message";
+cat > "$work/tenants" <<TENANTS
+# address time num message dir [ flag arsender ]
+Help@Example.NET 3600 5 $PWD/help_message $work/help 0
+@example.org 3600 1 :away $work/away 0 +
+:away $work/away_message
+TENANTS
+for i in $(seq 1 2000); do
+    echo "user$i@example.net 3600 5 $PWD/help_message $work/help 0";
+done >> "$work/tenants";
+
+# Deliver a message for $1@$2 from $3, print the exit code and the reply's Subject
+deliver() {
+    rm -f /tmp/qmail-queue-test.eml;
+    printf 'From: <%s>\nSubject: Hello\n\nHello.\n' "$3" |
+        EXT="$1" HOST="$2" SENDER="$3" RECIPIENT="${RECIPIENT:-$1@$2}" ./autorespond --cdb "$work/tenants.cdb" 2>/dev/null;
+    echo "$? $(grep -m1 '^Subject:' /tmp/qmail-queue-test.eml 2>/dev/null || echo none)";
+}
+
+check() {
+    local test_name="$1";
+    local expected="$2";
+    local got="$3";
+
+    if [[ "$got" == "$expected" ]]; then
+        echo -e "${GREEN}✓ $test_name${NC}";
+    else
+        echo -e "${RED}✗ $test_name${NC}";
+        echo "  Expected: $expected";
+        echo "  Got: $got";
+        failed=1;
+    fi
+}
+
+echo -e "\n${YELLOW}=== Testing autorespond --cdb ===${NC}\n";
+
+./autorespond-mkcdb "$work/tenants.cdb" "$work/tenants";
+check "autorespond-mkcdb builds the cdb" "0" "$?";
+
+check "an address in the cdb gets its reply" "0 Subject: Help Response" "$(deliver help example.net one@example.com)";
+check "one of many addresses gets its reply" "0 Subject: Help Response" "$(deliver user1999 example.net two@example.com)";
+check "a domain's entry answers for its addresses" "0 Subject: Away" "$(deliver anyone example.org three@example.com)";
+check "a template stored in the cdb is filled in" "Away, four@example.com." "$(deliver someone example.org four@example.com > /dev/null; grep '^Away' /tmp/qmail-queue-test.eml)";
+check "the entry's limit applies" "0 none" "$(deliver anyone example.org four@example.com)";
+check "RECIPIENT is looked up when EXT@HOST isn't there" "0 Subject: Help Response" \
+    "$(RECIPIENT=help@example.net deliver alias-help localhost five@example.com)";
+check "an address that isn't there gets no reply" "0 none" "$(deliver nobody example.com six@example.com)";
+
+printf 'bad@example.net 3600\n' > "$work/bad";
+./autorespond-mkcdb "$work/tenants.cdb" "$work/bad" 2>/dev/null;
+check "a bad line is an error" "111" "$?";
+check "and leaves the cdb as it was" "0 Subject: Help Response" "$(deliver help example.net seven@example.com)";
+
+# A sender list entry for one recipient, whatever the case of EXT and HOST
+mkdir "$work/config";
+echo "deny spammer@example.com Help@Example.NET" | ./autorespond-mkcdb -s "$work/config/senders.cdb";
+export AUTORESPOND_CONFIG="$work/config";
+check "a recipient's deny entry applies" "0 none" "$(deliver help example.net spammer@example.com)";
+check "in any case of EXT and HOST" "0 none" "$(deliver Help Example.NET spammer@example.com)";
+check "and only to that sender" "0 Subject: Help Response" "$(deliver HELP EXAMPLE.NET eight@example.com)";
+unset AUTORESPOND_CONFIG;
+
+# Clean up
+rm -rf "$work";
+rm -f /tmp/qmail-queue-test.eml;
+
+echo -e "\n${YELLOW}=== Test completed ===${NC}";
+exit $failed;
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Test script to verify autorespond-client against autorespond --daemon
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+# Create a stub qmail-queue if needed
+if [[ ! -f /var/qmail/bin/qmail-queue ]]; then
+    echo "Creating qmail-queue stub for testing...";
+    sudo mkdir -p /var/qmail/bin;
+    echo -e '#!/bin/bash\ncat > /tmp/qmail-queue-test.eml' > /var/qmail/bin/qmail-queue;
+    chmod +x /var/qmail/bin/qmail-queue;
+fi
+
+# Set required environment variables
+export SENDER="sender@example.com";
+export EXT="recipient";
+export HOST="example.net";
+export LOCAL="recipient";
+export AUTORESPOND_SOCKET="$(mktemp -u)";
+export AUTORESPOND_BIN="$PWD/autorespond";
+
+logs=$(mktemp -d);
+failed=0;
+
+# Deliver a message through the client, print the exit code and whether a reply was sent
+deliver() {
+    rm -f /tmp/qmail-queue-test.eml;
+    echo -e "$1" | ./autorespond-client 3600 5 help_message "$logs" 1 '$' 2>/dev/null;
+    echo "$? $([[ -f /tmp/qmail-queue-test.eml ]] && echo reply || echo none)";
+}
+
+check() {
+    local test_name="$1";
+    local expected="$2";
+    local got="$3";
+
+    if [[ "$got" == "$expected" ]]; then
+        echo -e "${GREEN}✓ $test_name${NC}";
+    else
+        echo -e "${RED}✗ $test_name${NC}";
+        echo "  Expected: $expected";
+        echo "  Got: $got";
+        failed=1;
+    fi
+}
+
+echo -e "\n${YELLOW}=== Testing autorespond daemon and client ===${NC}\n";
+
+./autorespond --daemon "$AUTORESPOND_SOCKET" 2>/dev/null &
+daemon=$!;
+sleep 0.5;
+
+check "daemon: personal email gets a reply" "0 reply" \
+    "$(deliver "From: John Doe <john@personal-email.com>\nSubject: Hello\n\nHello.")";
+SENDER="quote@example.com" deliver "From: Quote <quote@example.com>\nSubject: Hello\n\nQuoted line." > /dev/null;
+check "daemon: the reply quotes the message" "1" "$(grep -c '^> Quoted line.' /tmp/qmail-queue-test.eml)";
+check "daemon: bulk email is ignored" "0 none" \
+    "$(deliver "From: Bulk <bulk@company.com>\nPrecedence: bulk\n\nBulk.")";
+check "daemon: loops exit with a hard error" "100 none" \
+    "$(deliver "From: John Doe <john@personal-email.com>\nDelivered-To: Autoresponder\n\nLoop.")";
+check "daemon: stderr is passed back" "AUTORESPOND: Junk mail received." \
+    "$(echo -e "From: Bulk <bulk@company.com>\nPrecedence: bulk\n\nBulk." | ./autorespond-client 3600 5 help_message "$logs" 1 '$' 2>&1)";
+
+kill $daemon;
+wait $daemon 2>/dev/null;
+
+check "client: falls back without a daemon" "0 reply" \
+    "$(SENDER=other@example.com deliver "From: Other <other@example.com>\nSubject: Hello\n\nHello.")";
+
+# Clean up
+rm -rf "$logs";
+rm -f "$AUTORESPOND_SOCKET";
+rm -f /tmp/qmail-queue-test.eml;
+
+echo -e "\n${YELLOW}=== Test completed ===${NC}";
+exit $failed;
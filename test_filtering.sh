@@ -486,6 +486,219 @@ Subject: perhaps from a cron script
 
 Output from, e.g., crond. " 0;
 
+# Test 45: Blocked domain in the second address of the header (should not respond)
+run_test "Blocked domain in second address of Reply-To" \
+"Date: $(date -R)
+From: Carol <carol@example.org>
+Reply-To: Carol <carol@example.org>, Tracker <tracker@mailgun.net>
+To: recipient@example.net
+Subject: Shared document
+
+Document content." 0;
+
+# Test 46: Domain that only ends with a blocked domain name (should respond)
+export SENDER="dave@notzoom.us";
+run_test "Personal email from notzoom.us" \
+"Date: $(date -R)
+From: Dave <dave@notzoom.us>
+To: recipient@example.net
+Subject: Lunch
+
+Lunch tomorrow?" 1;
+export SENDER="sender@example.com";
+
+# Test 47: Role keyword only in the display name (should respond)
+export SENDER="jane@personalmail.com";
+run_test "Role keyword only in display name" \
+"Date: $(date -R)
+From: Jane (Customer Service) <jane@personalmail.com>
+To: recipient@example.net
+Subject: Personal note
+
+Just a personal note." 1;
+export SENDER="sender@example.com";
+
+# Test 48: Header after a header line longer than any buffer (should not respond)
+run_test "X-Mailgun-Tag after a 20000 byte header line" \
+"Date: $(date -R)
+From: user@server.example.com
+To: user@example.net
+X-Long: $(printf '%020000d' 0)
+X-Mailgun-Tag: campaign
+Subject: Long header
+
+Content." 0;
+
+# Test 49: Only the second Precedence header says bulk (should not respond)
+run_test "Precedence: bulk in a repeated Precedence header" \
+"Date: $(date -R)
+From: user@server.example.com
+To: user@example.net
+Precedence: normal
+Precedence: bulk
+Subject: Repeated header
+
+Content." 0;
+
+# Test 50: Our own Delivered-To below another hop's (should not respond)
+run_test "Delivered-To: Autoresponder after another Delivered-To" \
+"Date: $(date -R)
+Delivered-To: user@example.net
+Delivered-To: Autoresponder
+From: user@server.example.com
+To: user@example.net
+Subject: Loop
+
+Content." 0;
+
+# Tests 51-53: a rule file replaces the default rules
+config=$(mktemp -d);
+cat > "$config/rules" <<'RULES'
+# kind header pattern exit message
+regex	Subject	^out.of.office	0	Subject looks automatic: %s
+present	X-Custom-Bulk	0
+RULES
+export AUTORESPOND_CONFIG="$config";
+export SENDER="frank@personalmail.com";
+run_test "Rule file: regex on the Subject" \
+"Date: $(date -R)
+From: Frank <frank@personalmail.com>
+To: recipient@example.net
+Subject: Out of office until Monday
+
+Away." 0;
+run_test "Rule file: header named by a present rule" \
+"Date: $(date -R)
+From: Frank <frank@personalmail.com>
+To: recipient@example.net
+X-Custom-Bulk: yes
+Subject: Hello
+
+Hi." 0;
+run_test "Rule file: List-Id is not one of its rules (should respond)" \
+"Date: $(date -R)
+From: Frank <frank@personalmail.com>
+To: recipient@example.net
+List-Id: <friends.example.org>
+Subject: Hello
+
+Hi." 1;
+# Test 53b: the loop check is built in, a rule file can't leave it out
+printf 'Delivered-To: Autoresponder\nFrom: Frank <frank@personalmail.com>\nSubject: Hello\n\nHi.\n' \
+    | ./autorespond 3600 5 help_message "$logs" 1 '$' 2>/dev/null;
+code=$?;
+if [[ $code -eq 100 ]]; then
+    echo -e "${GREEN}✓ Rule file: Delivered-To: Autoresponder still exits 100${NC}";
+else
+    echo -e "${RED}✗ Rule file: Delivered-To: Autoresponder still exits 100${NC}";
+    echo "  Got: exit $code";
+fi
+unset AUTORESPOND_CONFIG;
+export SENDER="sender@example.com";
+rm -rf "$config";
+
+# Test 54: Early exit stops at the first header a rule matches (should not respond)
+export AUTORESPOND_EARLY_EXIT=1;
+run_test "Early exit on Precedence: bulk before a long header block" \
+"Date: $(date -R)
+Precedence: bulk
+X-Long: $(printf '%020000d' 0)
+From: Frank <frank@personalmail.com>
+To: recipient@example.net
+Subject: Newsletter
+
+Content." 0;
+unset AUTORESPOND_EARLY_EXIT;
+
+# Tests 55-61: Sender lists in senders.cdb
+config=$(mktemp -d);
+./autorespond-mkcdb -s "$config/senders.cdb" <<'LIST'
+deny spammer@personalmail.com
+deny @junk.example
+allow boss@bulkmail.example
+allow bulkmail.example recipient@example.net
+deny bulkmail.example other@example.net
+allow looping@personalmail.com
+LIST
+export AUTORESPOND_CONFIG="$config";
+export SENDER="spammer@personalmail.com";
+run_test "Sender list: denied envelope sender" \
+"Date: $(date -R)
+From: Spammer <spammer@personalmail.com>
+To: recipient@example.net
+Subject: Hello
+
+Hi." 0;
+export SENDER="grace@personalmail.com";
+run_test "Sender list: From in a denied domain's subdomain" \
+"Date: $(date -R)
+From: Junk <offers@mail.junk.example>
+To: recipient@example.net
+Subject: Hello
+
+Hi." 0;
+export SENDER="boss@bulkmail.example";
+run_test "Sender list: allowed sender gets a reply despite Precedence: bulk" \
+"Date: $(date -R)
+From: Boss <boss@bulkmail.example>
+To: recipient@example.net
+Precedence: bulk
+Subject: Hello
+
+Hi." 1;
+export SENDER="news@bulkmail.example";
+run_test "Sender list: domain allowed for this recipient overrides List-Id" \
+"Date: $(date -R)
+From: News <news@bulkmail.example>
+To: recipient@example.net
+List-Id: <news.bulkmail.example>
+Subject: Hello
+
+Hi." 1;
+export AUTORESPOND_EARLY_EXIT=1;
+run_test "Sender list: allowed envelope sender with early exit" \
+"Date: $(date -R)
+List-Id: <news.bulkmail.example>
+From: News <news@bulkmail.example>
+To: recipient@example.net
+Subject: Hello
+
+Hi." 1;
+unset AUTORESPOND_EARLY_EXIT;
+export SENDER="looping@personalmail.com";
+run_test "Sender list: allowed sender still stops on a loop" \
+"Date: $(date -R)
+From: Looping <looping@personalmail.com>
+To: recipient@example.net
+Delivered-To: Autoresponder
+Subject: Hello
+
+Hi." 0;
+export SENDER="helen@personalmail.com";
+run_test "Sender list: Reply-To on the deny list" \
+"Date: $(date -R)
+From: Helen <helen@personalmail.com>
+Reply-To: Someone <SPAMMER@personalmail.com>
+To: recipient@example.net
+Subject: Hello
+
+Hi." 0;
+unset AUTORESPOND_CONFIG;
+export SENDER="sender@example.com";
+rm -rf "$config";
+
+# Test 62: a pattern starting with a capital matches in a long header
+export SENDER="desk@personalmail.com";
+run_test "Long Delivered-To: Autoresponder header" \
+"Date: $(date -R)
+Delivered-To: Autoresponder for the help desk of example.net, do not reply
+From: user@server.example.com
+To: user@example.net
+Subject: Loop
+
+Content." 0;
+export SENDER="sender@example.com";
+
 # Clean up
 rm -rf "$logs";
 rm -f /tmp/test_output.txt;
@@ -0,0 +1,232 @@
+#!/bin/bash
+
+# Test script to verify how autorespond quotes the original message
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+# Create a stub qmail-queue if needed
+if [[ ! -f /var/qmail/bin/qmail-queue ]]; then
+    echo "Creating qmail-queue stub for testing...";
+    sudo mkdir -p /var/qmail/bin;
+    echo -e '#!/bin/bash\ncat > /tmp/qmail-queue-test.eml' > /var/qmail/bin/qmail-queue;
+    chmod +x /var/qmail/bin/qmail-queue;
+fi
+
+# Set required environment variables
+export EXT="recipient";
+export HOST="example.net";
+export LOCAL="recipient";
+
+logs=$(mktemp -d);
+mail=$(mktemp);
+failed=0;
+n=0;
+
+# Deliver $mail from sender number $n, as a file or through a pipe, print the quote
+quote() {
+    rm -f /tmp/qmail-queue-test.eml;
+    if [[ "$1" == "pipe" ]]; then
+        cat "$mail" | SENDER="quote$n@example.com" ./autorespond 3600 5 help_message "$logs" 1 '$' 2>/dev/null;
+    else
+        SENDER="quote$n@example.com" ./autorespond 3600 5 help_message "$logs" 1 '$' < "$mail" 2>/dev/null;
+    fi
+    sed -n '/^-------- Original Message --------$/,$p' /tmp/qmail-queue-test.eml 2>/dev/null | grep -e '^>' -e '^\[\.\.\. ';
+}
+
+check() {
+    local test_name="$1";
+    local expected="$2";
+    local got="$3";
+
+    if [[ "$got" == "$expected" ]]; then
+        echo -e "${GREEN}✓ $test_name${NC}";
+    else
+        echo -e "${RED}✗ $test_name${NC}";
+        echo "  Expected: $expected";
+        echo "  Got: $got";
+        failed=1;
+    fi
+}
+
+# check both ways of reading the message
+check_both() {
+    n=$((n + 1));
+    check "$1 (file)" "$2" "$(quote file)";
+    n=$((n + 1));
+    check "$1 (pipe)" "$2" "$(quote pipe)";
+}
+
+echo -e "\n${YELLOW}=== Testing quoting of the original message ===${NC}\n";
+
+cat > "$mail" <<'MAIL'
+From: Plain <plain@example.org>
+Subject: Plain
+
+First line.
+Second line.
+MAIL
+check_both "plain text is quoted" "> First line.
+> Second line.";
+
+cat > "$mail" <<'MAIL'
+From: Nested <nested@example.org>
+Subject: Nested
+MIME-Version: 1.0
+Content-Type: multipart/mixed; boundary="outer"
+
+Preamble.
+--outer
+Content-Type: application/pdf
+Content-Disposition: attachment; filename="a.pdf"
+Content-Transfer-Encoding: base64
+
+JVBERi0xLjQKJcfsj6IKNSAwIG9iago8PC9MZW5ndGggNiAwIFI+PgpzdHJlYW0K
+--outer
+Content-Type: multipart/alternative;
+	boundary=inner
+
+--inner
+Content-Type: text/html
+
+<p>html</p>
+--inner
+Content-Type: text/plain; charset=utf-8
+Content-Transfer-Encoding: quoted-printable
+
+Caf=C3=A9 on a line that was soft=
+ broken.
+--outer-like is no delimiter
+--inner--
+--outer--
+MAIL
+check_both "text/plain inside nested multiparts, quoted-printable" "> Café on a line that was soft broken.
+> --outer-like is no delimiter";
+
+cat > "$mail" <<'MAIL'
+From: Encoded <encoded@example.org>
+Subject: Base64
+Content-Type: text/plain
+Content-Transfer-Encoding: base64
+
+bGluZSBvbmUKbGluZSB0
+d28Kbm8gbmV3bGluZQ==
+MAIL
+check_both "base64 text is decoded" "> line one
+> line two
+> no newline";
+
+cat > "$mail" <<'MAIL'
+From: Attachment <attachment@example.org>
+Subject: Attachment
+Content-Type: multipart/mixed; boundary=b1
+
+--b1
+Content-Type: text/plain
+Content-Disposition: attachment; filename="log.txt"
+
+attached log
+--b1
+Content-Type: text/plain
+
+the message
+--b1--
+MAIL
+check_both "attached text is skipped" "> the message";
+
+cat > "$mail" <<'MAIL'
+From: Binary <binary@example.org>
+Subject: Binary
+Content-Type: application/octet-stream
+
+binary
+MAIL
+check_both "a body that is not text is not quoted" "";
+
+cat > "$mail" <<'MAIL'
+From: Long <long@example.org>
+Subject: Long
+
+one
+two
+three
+MAIL
+export AUTORESPOND_QUOTE_LINES=2;
+check_both "the quote stops at the line budget" "> one
+> two
+[... the rest of the original message was cut ...]";
+unset AUTORESPOND_QUOTE_LINES;
+
+export AUTORESPOND_QUOTE_BYTES=16;
+check_both "the quote stops at the byte budget" "> one
+> two
+> th
+[... the rest of the original message was cut ...]";
+unset AUTORESPOND_QUOTE_BYTES;
+
+export AUTORESPOND_QUOTE_LINES=3;
+check_both "a message that just fits is not cut" "> one
+> two
+> three";
+unset AUTORESPOND_QUOTE_LINES;
+
+{ printf 'From: Huge <huge@example.org>\nSubject: Huge\n\n'; seq 1 200000; } > "$mail";
+n=$((n + 1));
+# the budget, and the newline that ends the line it cut
+check "a large original is cut at the default budget" "65537" "$(quote pipe | grep '^>' | wc -c)";
+
+echo -e "\n${YELLOW}=== Testing reply templates ===${NC}\n";
+
+template=$(mktemp -d)/message;
+
+# Deliver $mail with $template from sender number $n, print the reply's body
+reply() {
+    rm -f /tmp/qmail-queue-test.eml;
+    SENDER="quote$n@example.com" ./autorespond 3600 5 "$template" "$logs" 0 '$' < "$mail" 2>/dev/null;
+    sed -n '/^Subject: Reply$/,$p' /tmp/qmail-queue-test.eml 2>/dev/null | sed -e '1,2d' -e '/^$/d';
+}
+
+cat > "$mail" <<'MAIL'
+From: Original <original@example.org>
+Subject:  Question
+Date: Mon, 1 Jan 2024 10:00:00 +0000
+Message-ID: <q1@example.org>
+
+body
+MAIL
+cat > "$template" <<'TEMPLATE'
+Subject: Reply
+
+Re: %{subject} (%{message-id}, %{date}) to %{recipient}: 100% %{unknown} %{
+TEMPLATE
+expected="Re: Question (<q1@example.org>, Mon, 1 Jan 2024 10:00:00 +0000) to recipient@example.net: 100% %{unknown} %{";
+n=$((n + 1));
+check "placeholders are filled in" "$expected" "$(reply)";
+check "X-Original-Subject is as before templates" "X-Original-Subject: Re:Question" \
+    "$(grep '^X-Original-Subject:' /tmp/qmail-queue-test.eml)";
+check "the parsed template is cached" "1" "$(head -c 6 "$template.cache" | grep -c ARTPL1)";
+n=$((n + 1));
+check "the cached template gives the same reply" "$expected" "$(reply)";
+
+cat > "$template" <<'TEMPLATE'
+Subject: Reply
+
+Hi %{sender}
+TEMPLATE
+n=$((n + 1));
+check "a changed template is parsed again" "Hi quote$n@example.com" "$(reply)";
+printf 'ARTPL1\n\0garbage' > "$template.cache";
+n=$((n + 1));
+check "a cache that isn't of the template is not used" "Hi quote$n@example.com" "$(reply)";
+rm -rf "$(dirname "$template")";
+
+# Clean up
+rm -rf "$logs";
+rm -f "$mail";
+rm -f /tmp/qmail-queue-test.eml;
+
+echo -e "\n${YELLOW}=== Test completed ===${NC}";
+exit $failed;
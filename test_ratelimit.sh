@@ -0,0 +1,165 @@
+#!/bin/bash
+
+# Test script to verify autorespond rate limiting
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+# Create a stub qmail-queue if needed
+if [[ ! -f /var/qmail/bin/qmail-queue ]]; then
+    echo "Creating qmail-queue stub for testing...";
+    sudo mkdir -p /var/qmail/bin;
+    echo -e '#!/bin/bash\ncat > /tmp/qmail-queue-test.eml' > /var/qmail/bin/qmail-queue;
+    chmod +x /var/qmail/bin/qmail-queue;
+fi
+
+# Set required environment variables
+export SENDER="sender@example.com";
+export EXT="recipient";
+export HOST="example.net";
+export LOCAL="recipient";
+
+failed=0;
+
+# Deliver one message from $SENDER, print 1 if a reply was sent, 0 otherwise
+deliver() {
+    local logs="$1";
+    rm -f /tmp/qmail-queue-test.eml;
+    printf 'From: Someone <%s>\nTo: recipient@example.net\nSubject: Hello\n\nHello.\n' "$SENDER" \
+        | ./autorespond 60 3 help_message "$logs" 0 '$' 2>/dev/null;
+    [[ -f /tmp/qmail-queue-test.eml ]] && echo 1 || echo 0;
+}
+
+# Function to run a test case: compare the replies of a run of deliveries
+check() {
+    local test_name="$1";
+    local expected="$2";
+    local got="$3";
+
+    if [[ "$got" == "$expected" ]]; then
+        echo -e "${GREEN}✓ $test_name${NC}";
+    else
+        echo -e "${RED}✗ $test_name${NC}";
+        echo "  Expected: $expected";
+        echo "  Got: $got";
+        failed=1;
+    fi
+}
+
+echo -e "\n${YELLOW}=== Testing autorespond rate limiting ===${NC}\n";
+
+for store in index files; do
+    export AUTORESPOND_STORE=$store;
+    logs=$(mktemp -d);
+
+    got="";
+    for i in 1 2 3 4 5; do got="$got$(deliver "$logs")"; done;
+    check "$store: replies stop after the limit" "11100" "$got";
+
+    SENDER="SENDER@Example.COM";
+    check "$store: sender addresses are compared case-insensitively" "0" "$(deliver "$logs")";
+
+    SENDER="other@example.com";
+    check "$store: other senders are counted separately" "1" "$(deliver "$logs")";
+    SENDER="sender@example.com";
+
+    rm -rf "$logs";
+done
+unset AUTORESPOND_STORE;
+
+# Concurrent deliveries from one sender never exceed the limit
+for store in index files; do
+    export AUTORESPOND_STORE=$store;
+    logs=$(mktemp -d);
+    for i in $(seq 1 20); do
+        printf 'From: Someone <%s>\nTo: recipient@example.net\nSubject: Hello\n\nHello.\n' "$SENDER" \
+            | ./autorespond 60 3 help_message "$logs" 0 '$' 2>&1 &
+    done | grep -c "Reply sent" > /tmp/test_output.txt;
+    wait;
+    check "$store: 20 concurrent deliveries get 3 replies" "3" "$(cat /tmp/test_output.txt)";
+    rm -rf "$logs";
+done
+unset AUTORESPOND_STORE;
+
+# An existing one file per message log is moved into the index
+logs=$(mktemp -d);
+for i in 1 2 3; do
+    echo -n "sender@example.com" > "$logs/A$i.$(date +%s).$RANDOM";
+done
+echo -n "sender@example.com" > "$logs/A9.1000.$RANDOM";
+check "index: existing log files are migrated" "0" "$(deliver "$logs")";
+check "index: migrated log files are removed" "autorespond.idx" "$(ls "$logs")";
+rm -rf "$logs";
+
+# The same log is moved into per-sender directories by the files store
+logs=$(mktemp -d);
+for i in 1 2 3; do
+    echo -n "Sender@Example.com" > "$logs/A$i.$(date +%s).$RANDOM";
+done
+echo -n "sender@example.com" > "$logs/A9.1000.$RANDOM";
+export AUTORESPOND_STORE=files;
+check "files: existing log files are migrated" "0" "$(deliver "$logs")";
+check "files: one directory per sender" "1" "$(ls -d "$logs"/S* | wc -l)";
+check "files: no A-files are left" "" "$(ls "$logs" | grep '^A')";
+unset AUTORESPOND_STORE;
+rm -rf "$logs";
+
+# A num larger than a slot of the index keeps uses the files store
+logs=$(mktemp -d);
+printf 'From: Someone <%s>\nSubject: Hello\n\nHello.\n' "$SENDER" \
+    | ./autorespond 60 10000 help_message "$logs" 0 '$' 2>/dev/null;
+check "a large num uses the files store" "no index, 1 sender" \
+    "$([[ -f "$logs/autorespond.idx" ]] && echo index || echo no index), $(ls -d "$logs"/S* | wc -l) sender";
+rm -rf "$logs";
+
+# Migrated entries are queued for expiry, so --gc collects them
+logs=$(mktemp -d);
+echo -n "other@example.com" > "$logs/A1.$(( $(date +%s) - 7200 )).$RANDOM";
+printf 'From: Someone <%s>\nSubject: Hello\n\nHello.\n' "$SENDER" \
+    | AUTORESPOND_STORE=files ./autorespond 100000 3 help_message "$logs" 0 '$' 2>/dev/null;
+check "migrate: the legacy sender gets a directory" "2" "$(ls -d "$logs"/S* | wc -l)";
+./autorespond --gc 3600 "$logs" 2>/dev/null;
+check "migrate: --gc removes its directory once expired" "1" "$(ls -d "$logs"/S* | wc -l)";
+rm -rf "$logs";
+
+# Expired entries are collected by --gc, oldest first
+logs=$(mktemp -d);
+touch "$logs/autorespond.files";
+mkdir -p "$logs/expire/100" "$logs/Sexpired" "$logs/Slive";
+touch "$logs/Sexpired/0000360000.1.1" "$logs/expire/100/Sexpired";
+touch "$logs/Slive/$(printf %010u "$(date +%s)").1.1" "$logs/expire/100/Slive";
+./autorespond --gc 3600 "$logs" 2>/dev/null;
+check "gc: expired senders are removed" "Slive autorespond.files expire" "$(ls "$logs" | xargs)";
+check "gc: collected buckets are removed" "" "$(ls "$logs/expire")";
+check "gc: live entries are kept" "1" "$(ls "$logs/Slive" | wc -l)";
+rm -rf "$logs";
+
+# With AUTORESPOND_TIMING a delivery logs one line of its stages
+timing() {
+    printf 'From: Someone <%s>\nTo: recipient@example.net\nSubject: Hello\n\nHello.\n' "$SENDER" \
+        | AUTORESPOND_TIMING=1 ./autorespond 60 1 help_message "$1" 0 '$' 2>&1 | grep '^AUTORESPOND: timing ';
+}
+logs=$(mktemp -d);
+line=$(timing "$logs");
+check "timing: a reply is logged" "decision=reply exit=0" "$(echo "$line" | grep -o 'decision=[a-z-]* exit=[0-9]*')";
+check "timing: every stage is there" "8" "$(echo "$line" | grep -o '_us=[0-9]*' | wc -l)";
+check "timing: bytes written are counted" "0" "$(echo "$line" | grep -c 'bytes_out=0 ')";
+check "timing: the limit is logged" "decision=rate-limit" "$(timing "$logs" | grep -o 'decision=[a-z-]*')";
+check "timing: the rule that decided is named" "rule=3:contains:Precedence:bulk" "$(printf 'From: x\nPrecedence: bulk\n\nx\n' \
+        | AUTORESPOND_TIMING=1 ./autorespond 60 1 help_message "$logs" 0 2>&1 | grep -o 'rule=[^ ]*')";
+check "timing: no rule is -" "rule=-" "$(echo "$line" | grep -o 'rule=[^ ]*')";
+mkdir -p "$logs.bad/autorespond.idx";
+check "timing: an index that won't open is an error" "decision=error exit=111" "$(timing "$logs.bad" | grep -o 'decision=[a-z-]* exit=[0-9]*')";
+rm -rf "$logs.bad";
+check "timing: off by default" "" "$(printf 'From: x\n\nx\n' | ./autorespond 60 1 help_message "$logs" 0 2>&1 | grep timing)";
+rm -rf "$logs";
+
+# Clean up
+rm -f /tmp/qmail-queue-test.eml;
+rm -f /tmp/test_output.txt;
+
+echo -e "\n${YELLOW}=== Test completed ===${NC}";
+exit $failed;